@@ -11,8 +11,30 @@
 #include <fstream>
 #include <sys/ioctl.h>
 #include <unistd.h>
-
-std::string version_no = "v0.0.2";
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <climits>
+#include <unordered_map>
+#include <atomic>
+#include <poll.h>
+#include <fcntl.h>
+#include <cstring>
+#include <mutex>
+#include <list>
+#include <bit>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <filesystem>
+#include <glob.h>
+
+std::string version_no = "v0.0.3";
+std::string legacy_version_no = "v0.0.2"; // Before layers
+std::string anim_version_no = "v0.0.2-anim";
+std::string session_version_no = "v0.0.3-session";
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
@@ -65,8 +87,361 @@ struct Point {
     }
 };
 
+enum ColorMode { TRUECOLOR, COLORS_256, COLORS_16 };
+
+/* Turns colors into SGR sequences for the selected color mode. The reduced modes find the nearest palette color
+ * through a table indexed by the top five bits of every channel, which is built once when the mode is selected.
+ * Ordered dithering is applied while encoding, since it depends on the position of the cell. */
+class Palette {
+    private:
+        static std::vector<uchar> lut;
+        static uchar colors[256][3];
+
+        static void fill_colors() {
+            static const uchar base16[16][3] = {
+                {0,0,0}, {205,0,0}, {0,205,0}, {205,205,0}, {0,0,238}, {205,0,205}, {0,205,205}, {229,229,229},
+                {127,127,127}, {255,0,0}, {0,255,0}, {255,255,0}, {92,92,255}, {255,0,255}, {0,255,255}, {255,255,255}
+            };
+            static const uchar levels[6] = {0, 95, 135, 175, 215, 255};
+
+            for (uint i = 0; i < 16; i++) std::copy(base16[i], base16[i] + 3, colors[i]);
+            for (uint i = 16; i < 232; i++) {
+                colors[i][0] = levels[(i - 16) / 36];
+                colors[i][1] = levels[(i - 16) / 6 % 6];
+                colors[i][2] = levels[(i - 16) % 6];
+            }
+            for (uint i = 232; i < 256; i++) colors[i][0] = colors[i][1] = colors[i][2] = 8 + 10 * (i - 232);
+        }
+
+        static void build() {
+            // The 256 color mode avoids the first 16 colors, since terminals theme them differently
+            uint first = mode == COLORS_16 ? 0 : 16;
+            uint last = mode == COLORS_16 ? 16 : 256;
+            fill_colors();
+
+            lut.resize(1 << 15);
+            for (uint i = 0; i < (1 << 15); i++) {
+                int r = ((i >> 10) << 3) | 4;
+                int g = (((i >> 5) & 31) << 3) | 4;
+                int b = ((i & 31) << 3) | 4;
+                uint best = first;
+                int best_dist = INT_MAX;
+                for (uint k = first; k < last; k++) {
+                    int dr = r - colors[k][0];
+                    int dg = g - colors[k][1];
+                    int db = b - colors[k][2];
+                    int dist = 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+                    if (dist < best_dist) {
+                        best_dist = dist;
+                        best = k;
+                    }
+                }
+                lut[i] = best;
+            }
+        }
+
+    public:
+        static ColorMode mode;
+        static bool dither;
+
+        /* The color which a terminal shows for index k of its 256 colors. */
+        static const uchar* rgb(uint k) {
+            static bool filled = (fill_colors(), true);
+            (void)filled;
+            return colors[k];
+        }
+
+        static void set_mode(ColorMode m) {
+            mode = m;
+            if (mode != TRUECOLOR) build();
+        }
+
+        /* Packs a color as it will be emitted, so encoders can tell when a color doesn't need to be sent again.
+         * Cells are dithered with a 4x4 Bayer matrix according to their position. */
+        static int key(uchar r, uchar g, uchar b, uint x = 0, uint y = 0, bool dithered = false) {
+            static const int bayer[4][4] = {{0,8,2,10}, {12,4,14,6}, {3,11,1,9}, {15,7,13,5}};
+
+            if (mode == TRUECOLOR) return r << 16 | g << 8 | b;
+            if (dithered && dither) {
+                int spread = mode == COLORS_16 ? 96 : 40;
+                int d = (2 * bayer[y & 3][x & 3] - 15) * spread / 32;
+                r = std::clamp(r + d, 0, 255);
+                g = std::clamp(g + d, 0, 255);
+                b = std::clamp(b + d, 0, 255);
+            }
+            return lut[(r >> 3) << 10 | (g >> 3) << 5 | (b >> 3)];
+        }
+
+        static std::string sgr(bool bg, int key) {
+            switch (mode) {
+                case COLORS_256: return std::format("\033[{};5;{}m", bg ? 48 : 38, key);
+                case COLORS_16: return std::format("\033[{}m", (bg ? 40 : 30) + (key & 7) + (key & 8 ? 60 : 0));
+                default: return std::format("\033[{};2;{};{};{}m", bg ? 48 : 38, key >> 16, (key >> 8) & 255, key & 255);
+            }
+        }
+};
+
+std::vector<uchar> Palette::lut;
+uchar Palette::colors[256][3];
+ColorMode Palette::mode = TRUECOLOR;
+bool Palette::dither = false;
+
+/* Appends colors and text to a line, only sending colors which differ from the ones already in effect. */
+struct CellEncoder {
+    static const int UNKNOWN = -1;
+    static const int DEFAULT = -2;
+
+    std::string& line;
+    int bg;
+    int fg;
+
+    CellEncoder(std::string& line) : line{line}, bg{UNKNOWN}, fg{UNKNOWN} {}
+
+    void reset() {
+        if (bg != DEFAULT || fg != DEFAULT) line += "\033[0m";
+        bg = fg = DEFAULT;
+    }
+
+    void default_bg() {
+        if (bg == DEFAULT) return;
+        line += "\033[49m";
+        bg = DEFAULT;
+    }
+
+    void color(bool is_bg, int key) {
+        int& last = is_bg ? bg : fg;
+        if (last == key) return;
+        line += Palette::sgr(is_bg, key);
+        last = key;
+    }
+};
+
 enum PixelCode { NONE, TRANSPARENT, BOUNDARY, TEMP };
 
+/* Reads ANSI art a chunk at a time with a state machine, so earlier input is never looked at again. The art is kept
+ * as a grid of terminal cells. Bytes which aren't valid UTF-8 are read as code page 437, like most legacy art, and
+ * a SAUCE record (after ^Z) ends the art. */
+class AnsiParser {
+    public:
+        static const int DEFAULT = -1; // The terminal's own color, otherwise colors are 0xRRGGBB
+        static constexpr uint MAX_COLUMNS = 1024; // Art is cut off here, so a broken file can't make a huge canvas
+        static constexpr uint MAX_ROWS = 4096;
+
+        struct Cell {
+            char32_t glyph;
+            int fg;
+            int bg;
+        };
+
+        std::vector<std::vector<Cell>> rows;
+
+    private:
+        enum State { GROUND, ESCAPE, CSI, STRING, STRING_ESCAPE, DONE };
+
+        State state;
+        std::string params;      // Of the control sequence being read
+        std::vector<int> numbers;
+        uint x, y, saved_x, saved_y;
+        int fg, bg;
+        int fg_index;            // The 16 color index of fg, if it has one, which bold brightens
+        bool bold, reverse;
+        bool cut;                // If anything was put past the limits
+        std::string utf8;        // The bytes of an unfinished UTF-8 character
+        char32_t code_point;
+        uint utf8_left;
+
+        static int indexed(uint k) {
+            const uchar* c = Palette::rgb(k);
+            return c[0] << 16 | c[1] << 8 | c[2];
+        }
+
+        static char32_t cp437(uchar c) {
+            static const char32_t high[] = U"ÇüéâäàåçêëèïîìÄÅÉæÆôöòûùÿÖÜ¢£¥₧ƒáíóúñÑªº¿⌐¬½¼¡«»░▒▓│┤╡╢╖╕╣║╗╝╜╛┐"
+                U"└┴┬├─┼╞╟╚╔╩╦╠═╬╧╨╤╥╙╘╒╓╫╪┘┌█▄▌▐▀αßΓπΣσµτΦΘΩδ∞φε∩≡±≥≤⌠⌡÷≈°∙·√ⁿ²■\u00A0";
+            static_assert(sizeof(high) / sizeof(*high) == 129);
+            return c < 128 ? c : high[c - 128];
+        }
+
+        /* Keeps the cursor within the limits, so moving it far and back can't wrap around. */
+        void clamp() {
+            x = std::min(x, MAX_COLUMNS);
+            y = std::min(y, MAX_ROWS);
+        }
+
+        void put(char32_t glyph) {
+            if (x >= MAX_COLUMNS || y >= MAX_ROWS) {
+                cut = true;
+                return;
+            }
+            if (rows.size() <= y) rows.resize(y + 1);
+            std::vector<Cell>& row = rows[y];
+            if (row.size() <= x) row.resize(x + 1, Cell{' ', DEFAULT, DEFAULT});
+            row[x++] = reverse ? Cell{glyph, bg, fg} : Cell{glyph, fg, bg};
+        }
+
+        void set_fg_index(int k) {
+            fg_index = k;
+            fg = indexed(bold && k < 8 ? k + 8 : k);
+        }
+
+        void sgr(const std::vector<int>& n) {
+            for (uint i = 0; i < n.size(); i++) {
+                int p = n[i];
+                if (p == 0) {
+                    fg = bg = DEFAULT;
+                    fg_index = -1;
+                    bold = reverse = false;
+                } else if (p == 1 || p == 22) {
+                    bold = p == 1;
+                    if (fg_index >= 0 && fg_index < 8) set_fg_index(fg_index);
+                } else if (p == 7 || p == 27) reverse = p == 7;
+                else if (p >= 30 && p <= 37) set_fg_index(p - 30);
+                else if (p >= 90 && p <= 97) set_fg_index(p - 90 + 8);
+                else if (p >= 40 && p <= 47) bg = indexed(p - 40);
+                else if (p >= 100 && p <= 107) bg = indexed(p - 100 + 8);
+                else if (p == 39) fg = DEFAULT, fg_index = -1;
+                else if (p == 49) bg = DEFAULT;
+                else if ((p == 38 || p == 48) && i + 1 < n.size()) {
+                    int color;
+                    if (n[i + 1] == 5 && i + 2 < n.size()) {
+                        color = indexed(std::clamp(n[i + 2], 0, 255));
+                        i += 2;
+                    } else if (n[i + 1] == 2 && i + 4 < n.size()) {
+                        color = std::clamp(n[i + 2], 0, 255) << 16 | std::clamp(n[i + 3], 0, 255) << 8 | std::clamp(n[i + 4], 0, 255);
+                        i += 4;
+                    } else break;
+                    if (p == 38) fg = color, fg_index = -1;
+                    else bg = color;
+                }
+            }
+        }
+
+        void control(char final) {
+            if (!params.empty() && params[0] == '?') return; // Private modes, like hiding the cursor
+            std::vector<int>& n = numbers;
+            n.clear();
+            if (!params.empty()) n.push_back(-1); // Missing numbers are -1
+            for (char c : params) {
+                if (c == ';' || c == ':') n.push_back(-1);
+                else if (c >= '0' && c <= '9') n.back() = std::min(std::max(n.back(), 0) * 10 + c - '0', 100000);
+            }
+            auto arg = [&](uint i, int fallback) { return i < n.size() && n[i] > 0 ? n[i] : fallback; };
+
+            switch (final) {
+                case 'm':
+                    if (n.empty()) n.push_back(0);
+                    for (int& p : n) if (p < 0) p = 0;
+                    sgr(n);
+                    break;
+                case 'H': case 'f': y = arg(0, 1) - 1; x = arg(1, 1) - 1; break;
+                case 'A': y -= std::min<uint>(y, arg(0, 1)); break;
+                case 'B': y += arg(0, 1); break;
+                case 'C': x += arg(0, 1); break;
+                case 'D': x -= std::min<uint>(x, arg(0, 1)); break;
+                case 'E': y += arg(0, 1); x = 0; break;
+                case 'F': y -= std::min<uint>(y, arg(0, 1)); x = 0; break;
+                case 'G': x = arg(0, 1) - 1; break;
+                case 'd': y = arg(0, 1) - 1; break;
+                case 's': saved_x = x; saved_y = y; break;
+                case 'u': x = saved_x; y = saved_y; break;
+                default: break; // Erasing and the rest don't change the art
+            }
+            clamp();
+        }
+
+        void ground(uchar c) {
+            if (utf8_left > 0) {
+                if ((c & 0xC0) == 0x80) {
+                    utf8 += c;
+                    code_point = code_point << 6 | (c & 0x3F);
+                    if (--utf8_left == 0) put(code_point);
+                    return;
+                }
+                for (uchar b : utf8) put(cp437(b)); // Not UTF-8 after all
+                utf8_left = 0;
+            }
+
+            if (c == 0x1B) state = ESCAPE;
+            else if (c == 0x1A) state = DONE;
+            else if (c == '\r') x = 0;
+            else if (c == '\n') {
+                y = std::min(y + 1, MAX_ROWS);
+                x = 0;
+            } else if (c == '\t') x = std::min((x / 8 + 1) * 8, MAX_COLUMNS);
+            else if (c == '\b') x -= x > 0;
+            else if (c < 0x20 || c == 0x7F) return;
+            else if (c < 0x80) put(c);
+            else if (c >= 0xC2 && c <= 0xF4) {
+                utf8 = std::string(1, c);
+                utf8_left = c < 0xE0 ? 1 : c < 0xF0 ? 2 : 3;
+                code_point = c & (0x3F >> utf8_left);
+            } else put(cp437(c));
+        }
+
+    public:
+        AnsiParser() : state{GROUND}, x{0}, y{0}, saved_x{0}, saved_y{0}, fg{DEFAULT}, bg{DEFAULT}, fg_index{-1}, bold{false},
+            reverse{false}, cut{false}, code_point{0}, utf8_left{0} {}
+
+        void feed(const char* data, size_t n) {
+            for (size_t i = 0; i < n && state != DONE; i++) {
+                uchar c = data[i];
+                switch (state) {
+                    case GROUND: ground(c); break;
+                    case ESCAPE:
+                        state = GROUND;
+                        if (c == '[') {
+                            state = CSI;
+                            params.clear();
+                        } else if (c == ']' || c == 'P' || c == '_' || c == '^' || c == 'X') state = STRING;
+                        else if (c == '7') saved_x = x, saved_y = y;
+                        else if (c == '8') x = saved_x, y = saved_y;
+                        break;
+                    case CSI:
+                        if (c >= 0x40 && c <= 0x7E) {
+                            state = GROUND;
+                            control(c);
+                        } else if (c >= 0x30 && c <= 0x3F && params.size() < 256) params += c;
+                        else if (c < 0x20 || c > 0x7E) state = GROUND; // Not a control sequence after all
+                        break;
+                    case STRING: // Operating system commands and the like are skipped
+                        if (c == 0x07) state = GROUND;
+                        else if (c == 0x1B) state = STRING_ESCAPE;
+                        break;
+                    case STRING_ESCAPE: state = c == '\\' ? GROUND : STRING; break;
+                    case DONE: break;
+                }
+            }
+        }
+
+        void finish() {
+            if (utf8_left > 0) for (uchar b : utf8) put(cp437(b));
+            utf8_left = 0;
+        }
+
+        /* If some of the art was past MAX_COLUMNS or MAX_ROWS, and was left out. */
+        bool was_cut() const { return cut; }
+
+        /* The number of columns of the widest row. */
+        uint columns() const {
+            size_t n = 0;
+            for (const std::vector<Cell>& row : rows) n = std::max(n, row.size());
+            return n;
+        }
+
+        static AnsiParser parse_file(const std::string& filename) {
+            std::ifstream input_file(filename, std::ios::binary);
+            if (!input_file) throw std::invalid_argument(std::format("Can't open {}", filename).c_str());
+            AnsiParser parser;
+            std::vector<char> buf(1 << 16);
+            while (input_file) {
+                input_file.read(buf.data(), buf.size());
+                parser.feed(buf.data(), input_file.gcount());
+            }
+            parser.finish();
+            return parser;
+        }
+};
+
 struct Pixel {
     static Pixel white;
     static Pixel black;
@@ -96,6 +471,12 @@ struct Pixel {
             code = TEMP;
             return *this;
         }
+        copy(c);
+        return *this;
+    }
+
+    /* Copies everything from c, which assignment doesn't do for previewed (TEMP) pixels. */
+    void copy(const Pixel& c) {
         r = c.r;
         g = c.g;
         b = c.b;
@@ -105,7 +486,6 @@ struct Pixel {
         fg_g = c.fg_g;
         fg_b = c.fg_b;
         text = c.text;
-        return *this;
     }
     Pixel& operator=(Pixel&& c) {
         if (c.code == TEMP) {
@@ -142,11 +522,184 @@ struct Pixel {
     }
 
     std::string bg() const {
-        return std::format("\033[48;2;{};{};{}m", r, g, b);
+        return Palette::sgr(true, Palette::key(r, g, b));
     }
 
     std::string fg() const {
-        return std::format("\033[38;2;{};{};{}m", r, g, b);
+        return Palette::sgr(false, Palette::key(r, g, b));
+    }
+
+    bool operator==(const Pixel& c) const {
+        return r == c.r && g == c.g && b == c.b && code == c.code && fg_r == c.fg_r && fg_g == c.fg_g && fg_b == c.fg_b && text == c.text;
+    }
+    bool operator!=(const Pixel& c) const {
+        return !(*this == c);
+    }
+
+    /* Pixels are stored as their colors, foreground, code and two characters of text. */
+    void write(std::ostream& output) const {
+        output << r << g << b << fg_r << fg_g << fg_b;
+        output.write(reinterpret_cast<const char*>(&code), sizeof(code));
+        output.write(text.c_str(), 2);
+    }
+
+    /* Encodes the pixel like write, into RECORD_SIZE bytes at out. */
+    void write_record(char* out) const {
+        out[0] = r;
+        out[1] = g;
+        out[2] = b;
+        out[3] = fg_r;
+        out[4] = fg_g;
+        out[5] = fg_b;
+        std::memcpy(out + 6, &code, sizeof(code));
+        out[6 + sizeof(code)] = text.size() > 0 ? text[0] : 0;
+        out[7 + sizeof(code)] = text.size() > 1 ? text[1] : 0;
+    }
+
+    static Pixel read(std::istream& input) {
+        uchar r,g,b,fg_r,fg_g,fg_b;
+        PixelCode code;
+        char buf[3] = {0};
+
+        input.read(reinterpret_cast<char*>(&r), 1);
+        input.read(reinterpret_cast<char*>(&g), 1);
+        input.read(reinterpret_cast<char*>(&b), 1);
+        input.read(reinterpret_cast<char*>(&fg_r), 1);
+        input.read(reinterpret_cast<char*>(&fg_g), 1);
+        input.read(reinterpret_cast<char*>(&fg_b), 1);
+        input.read(reinterpret_cast<char*>(&code), sizeof(code));
+        input.read(buf, 2);
+        return Pixel(r,g,b,fg_r,fg_g,fg_b,std::string(buf),code);
+    }
+
+    static const size_t RECORD_SIZE = 6 + sizeof(PixelCode) + 2; // The size of a pixel in a file
+
+    /* Reads n pixels in one go, which is much faster than reading them one at a time. */
+    static void read_all(std::istream& input, Pixel* pixels, size_t n) {
+        std::vector<char> data(n * RECORD_SIZE);
+        input.read(data.data(), data.size());
+        for (size_t i = 0; i < n; i++) {
+            const char* p = &data[i * RECORD_SIZE];
+            PixelCode code;
+            std::memcpy(&code, p + 6, sizeof(code));
+            const char* text = p + 6 + sizeof(code);
+            pixels[i] = Pixel(p[0], p[1], p[2], p[3], p[4], p[5], std::string(text, text[0] == 0 ? 0 : text[1] == 0 ? 1 : 2), code);
+        }
+    }
+
+    /* Mixes everything which affects how this pixel is drawn into h. */
+    uint64_t hash(uint64_t h) const {
+        uint64_t w = (uint64_t)r | (uint64_t)g << 8 | (uint64_t)b << 16 | (uint64_t)fg_r << 24 | (uint64_t)fg_g << 32 | (uint64_t)fg_b << 40 | (uint64_t)code << 48;
+        uint64_t t = text.size() | (text.size() > 0 ? (uchar)text[0] << 8 : 0) | (text.size() > 1 ? (uchar)text[1] << 16 : 0);
+        h = (h ^ w) * 0x9e3779b97f4a7c15;
+        h = (h ^ (h >> 29) ^ t) * 0xbf58476d1ce4e5b9;
+        return h ^ (h >> 32);
+    }
+
+    /* Appends the escape sequences for this pixel, at column x of row y, to the encoder's line. The editor shows
+     * transparent pixels as dots, and onion is shown dimmed underneath them if it is given. */
+    void encode(CellEncoder& e, bool editor, uint x, uint y, const Pixel* onion = NULL) const {
+        switch (code) {
+            case NONE: {
+                e.color(true, Palette::key(r, g, b, x, y, true));
+                if (text.compare(0, 2, "  ") != 0) e.color(false, Palette::key(fg_r, fg_g, fg_b));
+                e.line.append(text, 0, 2);
+                break;
+            }
+            case TRANSPARENT:
+                if (!editor) {
+                    e.reset();
+                    e.line += "  ";
+                    break;
+                }
+                if (onion != NULL && onion->code == NONE) e.color(true, Palette::key((onion->r + 128) / 2, (onion->g + 128) / 2, (onion->b + 128) / 2, x, y, true));
+                else e.reset();
+                e.color(false, Palette::key(255, 255, 255));
+                e.line += "..";
+                break;
+            case BOUNDARY: {
+                Pixel rev = get_reverse();
+                e.color(true, Palette::key(r, g, b, x, y, true));
+                e.color(false, Palette::key(rev.r, rev.g, rev.b));
+                e.line += "::";
+                break;
+            }
+            case TEMP:
+                e.color(true, Palette::key(255, 255, 255));
+                e.color(false, Palette::key(0, 0, 0));
+                e.line += "##";
+                break;
+            default: e.line += "  "; break;
+        }
+    }
+
+    /* Finds the color of this pixel when it only fills half of a cell, returning false if the terminal's
+     * background should show through. The editor shows transparent pixels as a checkerboard. */
+    bool half_key(int& key, bool editor, uint x, uint y, const Pixel* onion = NULL) const {
+        switch (code) {
+            case NONE:
+            case BOUNDARY: key = Palette::key(r, g, b, x, y, true); return true;
+            case TEMP: key = Palette::key(255, 255, 255); return true;
+            case TRANSPARENT: {
+                if (!editor) return false;
+                if (onion != NULL && onion->code == NONE)
+                    key = Palette::key((onion->r + 128) / 2, (onion->g + 128) / 2, (onion->b + 128) / 2, x, y, true);
+                else {
+                    uchar c = (x + y) % 2 ? 96 : 64;
+                    key = Palette::key(c, c, c);
+                }
+                return true;
+            }
+            default: return false;
+        }
+    }
+
+    /* Finds the color of this pixel in an image, in the same way as half_key. Pixels which the terminal's
+     * background should show through get an alpha of 0. */
+    void rgba(uchar* out, bool editor, uint x, uint y, const Pixel* onion = NULL) const {
+        uchar c = (x + y) % 2 ? 96 : 64;
+        switch (code) {
+            case NONE:
+            case BOUNDARY: out[0] = r; out[1] = g; out[2] = b; out[3] = 255; return;
+            case TEMP: out[0] = out[1] = out[2] = out[3] = 255; return;
+            case TRANSPARENT:
+                if (!editor) break;
+                if (onion != NULL && onion->code == NONE) {
+                    out[0] = (onion->r + 128) / 2;
+                    out[1] = (onion->g + 128) / 2;
+                    out[2] = (onion->b + 128) / 2;
+                } else out[0] = out[1] = out[2] = c;
+                out[3] = 255;
+                return;
+            default: break;
+        }
+        out[0] = out[1] = out[2] = out[3] = 0;
+    }
+
+    /* Appends a single cell showing top above bottom with a half block. bottom may be NULL below the last row
+     * of a canvas with an odd height. Text can't fit in half a cell, so it isn't shown. */
+    static void encode_half(CellEncoder& e, const Pixel& top, const Pixel* bottom, bool editor, uint x, uint y,
+            const Pixel* onion_top = NULL, const Pixel* onion_bottom = NULL) {
+        int top_key, bottom_key;
+        bool has_top = top.half_key(top_key, editor, x, y, onion_top);
+        bool has_bottom = bottom != NULL && bottom->half_key(bottom_key, editor, x, y + 1, onion_bottom);
+
+        if (has_top && has_bottom) {
+            e.color(true, bottom_key);
+            if (top_key == bottom_key) {
+                e.line += ' ';
+                return;
+            }
+            e.color(false, top_key);
+            e.line += "\u2580";
+        } else if (has_top || has_bottom) {
+            e.default_bg();
+            e.color(false, has_top ? top_key : bottom_key);
+            e.line += has_top ? "\u2580" : "\u2584";
+        } else {
+            e.default_bg();
+            e.line += ' ';
+        }
     }
 };
 
@@ -158,231 +711,2294 @@ Pixel Pixel::blue(0,0,255);
 Pixel Pixel::temp(0,0,0,0,0,0,"  ",TEMP);
 Pixel Pixel::transparent(0,0,0,0,0,0,"  ",TRANSPARENT);
 
-class Canvas {
-    private:
-        struct CanvasHolder {
-            Pixel* canvas;
-            uint width;
-            uint height;
-
-            CanvasHolder(Pixel* canvas, uint width, uint height) : canvas{canvas}, width{width}, height{height} {}
-        };
+/* Images are decoded one row at a time into RGBA, so that large images never have to be held in memory. */
+class ImageReader {
+    public:
+        virtual ~ImageReader() {}
+        virtual uint get_width() =0;
+        virtual uint get_height() =0;
+        virtual void read_row(uchar* rgba) =0;
+};
 
-        Pixel* canvas;
-        std::vector<CanvasHolder> past_canvases;
-        std::set<uint> update_lines;
-        std::set<Point<Point<uint>>> boundary_points;
+/* Reads binary and plain PPM and PGM files (P2, P3, P5 and P6). */
+class PnmReader : public ImageReader {
+    private:
+        std::ifstream input_file;
         uint width;
         uint height;
+        uint maxval;
+        uint channels;
+        bool plain;
+        std::vector<uchar> buf;
 
-        void check_point(Point<uint> p) {
-            if (p.x >= width || p.y >= height) throw std::invalid_argument(std::format("Invalid point ({},{}) in dimensions {}x{}", p.x, p.y, width, height).c_str());
+        uint read_number() {
+            char c;
+            input_file.get(c);
+            while (std::isspace(c) || c == '#') {
+                if (c == '#') while (c != '\n') input_file.get(c);
+                input_file.get(c);
+            }
+
+            if (!std::isdigit(c)) throw std::invalid_argument("Invalid number in PPM or PGM file");
+            uint n = c - '0';
+            while (std::isdigit(input_file.peek())) n = n * 10 + input_file.get() - '0';
+            return n;
         }
 
-        bool intersects(Point<uint> p1, Point<uint> p2, Point<uint> p3, Point<uint> p4) {
-            int x1 = p1.x;
-            int x2 = p2.x;
-            int x3 = p3.x;
-            int x4 = p4.x;
-            int y1 = p1.y;
-            int y2 = p2.y;
-            int y3 = p3.y;
-            int y4 = p4.y;
-            int a = x1 - x2;
-            int b = x4 - x3;
-            int c = y1 - y2;
-            int d = y4 - y3;
-            int e = x4 - x2;
-            int f = y4 - y2;
-            int det = a * d - b * c;
+    public:
+        PnmReader(std::string filename) {
+            input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            input_file.open(filename, std::ios::binary | std::ios::in);
 
-            if (det != 0) { // Matrix is invertible; single solution
-                int t = d * e - b * f;
-                int s = a * f - c * e;
+            char magic[2];
+            input_file.read(magic, 2);
+            if (magic[0] != 'P' || (magic[1] != '2' && magic[1] != '3' && magic[1] != '5' && magic[1] != '6'))
+                throw std::invalid_argument(std::format("{} is not a PPM or PGM file", filename).c_str());
+
+            plain = magic[1] == '2' || magic[1] == '3';
+            channels = (magic[1] == '3' || magic[1] == '6') ? 3 : 1;
+            width = read_number();
+            height = read_number();
+            maxval = read_number();
+            if (!plain) input_file.ignore(1); // A single whitespace separates the header from the binary data
+            if (width == 0 || height == 0 || maxval == 0 || maxval > 65535)
+                throw std::invalid_argument(std::format("Invalid header in {}", filename).c_str());
+
+            buf.resize(width * channels * (maxval > 255 ? 2 : 1));
+        }
 
-                if (det > 0) {
-                    return 0 <= t && t <= det && 0 <= s && s <= det;
-                } else {
-                    return det <= t && t <= 0 && det <= s && s <= 0;
+        uint get_width() override { return width; }
+        uint get_height() override { return height; }
+
+        void read_row(uchar* rgba) override {
+            uint n = width * channels;
+
+            if (plain) {
+                for (uint i = 0; i < n; i++) {
+                    uint v = read_number();
+                    buf[i] = std::min(v, maxval) * 255 / maxval;
                 }
-            } else { //  Matrix is singular
-                if (a != 0) {
-                    double alpha = (double)b / a;
-                    if (a * f != e * c) return false; // No solutions
-                    if (alpha > 0) {
-                        return std::max(0., (double)e / a - alpha) <= std::min(1., (double)e / a);
-                    } else {
-                        return std::max(0., (double)e / a) <= std::min(1., (double)e / a - alpha);
-                    }
+            } else {
+                input_file.read(reinterpret_cast<char*>(buf.data()), buf.size());
+                if (maxval > 255) {
+                    for (uint i = 0; i < n; i++) buf[i] = ((buf[2 * i] << 8) | buf[2 * i + 1]) * 255 / maxval;
+                } else if (maxval != 255) {
+                    for (uint i = 0; i < n; i++) buf[i] = std::min((uint)buf[i], maxval) * 255 / maxval;
+                }
+            }
+
+            for (uint i = 0; i < width; i++) {
+                if (channels == 3) {
+                    rgba[4 * i] = buf[3 * i];
+                    rgba[4 * i + 1] = buf[3 * i + 1];
+                    rgba[4 * i + 2] = buf[3 * i + 2];
                 } else {
-                    if (d != 0) {
-                        double alpha = (double)c / d;
-                        if (b != 0) {
-                            double s = (double)e / b;
-                            double t = ((double)f / d - s) / alpha;
-                            return 0 <= s && s <= 1 && 0 <= t && t <= 1;
-                        } else {
-                            if (e != 0) return false;
-                            if (alpha > 0) {
-                                return std::max(0., (double)f / d - alpha) <= std::min(1., (double)f / d);
-                            } else {
-                                return std::max(0., (double)f / d) <= std::min(1., (double)f / d - alpha);
-                            }
-                        }
-                    } else {
-                        if (e != 0 || f != 0) return false;
-                        return true;
-                    }
+                    rgba[4 * i] = rgba[4 * i + 1] = rgba[4 * i + 2] = buf[i];
                 }
+                rgba[4 * i + 3] = 255;
             }
         }
+};
 
-        bool in_area(Point<uint> p, Point<uint> center) {
-            uint count = 0;
-
-            for (const Point<Point<uint>>& b : boundary_points) {
-                if (intersects(b.x, b.y, p, center)) count++;
+/* Decompresses a zlib stream on demand. Compressed bytes are pulled from source whenever more are needed, and only
+ * the 32K window required for back-references is kept. */
+class Inflater {
+    private:
+        static const uint FAST_BITS = 9;
+        static const uint WINDOW = 1 << 15;
+
+        struct Huffman {
+            std::vector<ushort> fast;   // (symbol << 4) | length for codes of at most FAST_BITS bits
+            ushort count[16];
+            std::vector<ushort> symbols;
+
+            void build(const uchar* lengths, uint n) {
+                ushort offsets[16];
+                std::fill(count, count + 16, 0);
+                for (uint i = 0; i < n; i++) count[lengths[i]]++;
+                count[0] = 0;
+
+                offsets[1] = 0;
+                for (uint i = 1; i < 15; i++) offsets[i + 1] = offsets[i] + count[i];
+                symbols.assign(n, 0);
+                for (uint i = 0; i < n; i++)
+                    if (lengths[i] != 0) symbols[offsets[lengths[i]]++] = i;
+
+                fast.assign(1 << FAST_BITS, 0);
+                uint code = 0;
+                uint k = 0;
+                for (uint len = 1; len <= FAST_BITS; len++) {
+                    for (uint i = 0; i < count[len]; i++, k++, code++) {
+                        uint rev = 0;
+                        for (uint b = 0; b < len; b++) rev |= ((code >> b) & 1) << (len - 1 - b);
+                        for (uint j = rev; j < (1u << FAST_BITS); j += 1 << len) fast[j] = (symbols[k] << 4) | len;
+                    }
+                    code <<= 1;
+                }
             }
+        };
 
-            return count % 2 == 0;
-        }
-
-        void reset_temp() {
-            for (int i = 0; i < width; i++) {
-                for (int j = 0; j < height; j++) {
-                    Pixel& c = canvas[j * width + i];
-                    if (c.code == TEMP) {
-                        c.code = c.prev_code;
-                        update_lines.insert(j);
+        enum State { ZLIB_HEADER, BLOCK_HEADER, STORED, COMPRESSED, DONE };
+
+        std::function<size_t(const uchar*&)> source;
+        const uchar* in;
+        const uchar* in_end;
+        bool ended;
+        unsigned long long bits;
+        uint bit_count;
+
+        State state;
+        bool last_block;
+        uint stored_left;
+        uint copy_len;
+        uint copy_dist;
+        Huffman lit;
+        Huffman dist;
+        std::vector<uchar> window;
+        uint window_pos;
+
+        /* Tops up the bit buffer with as many whole bytes as fit, stopping quietly at the end of the input. */
+        void fill() {
+            while (bit_count <= 56) {
+                if (in == in_end) {
+                    if (ended) return;
+                    size_t len = source(in);
+                    if (len == 0) {
+                        ended = true;
+                        return;
                     }
+                    in_end = in + len;
                 }
+                bits |= (unsigned long long)*in++ << bit_count;
+                bit_count += 8;
             }
         }
 
-    public:
-        Canvas(uint width, uint height, Pixel bg = Pixel::transparent) : width{width}, height{height} {
-            canvas = new Pixel[width * height];
-            for (int i = 0; i < width * height; i++) canvas[i] = bg;
-            for (int i = 0; i < height; i++) update_lines.insert(i);
+        void need(uint n) {
+            if (bit_count < n) fill();
+            if (bit_count < n) throw std::invalid_argument("Unexpected end of compressed data");
         }
 
-        Canvas(std::string filename) {
-            std::ifstream input_file;
-            input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-            input_file.open(filename, std::ios::binary | std::ios::in);
-
-            std::string vno;
-            char c;
+        uint get_bits(uint n) {
+            need(n);
+            uint v = bits & ((1ull << n) - 1);
+            bits >>= n;
+            bit_count -= n;
+            return v;
+        }
 
-            while (true) {
-                input_file >> c;
-                if (c != 0) {
-                    vno += c;
-                } else break;
+        uint decode(const Huffman& h) {
+            if (bit_count < FAST_BITS) fill();
+            ushort e = h.fast[bits & ((1 << FAST_BITS) - 1)];
+            if (e != 0 && (e & 15) <= bit_count) {
+                bits >>= e & 15;
+                bit_count -= e & 15;
+                return e >> 4;
             }
 
-            if (vno != version_no) throw std::invalid_argument(std::format("Invalid version: current {} vs {}", version_no, vno).c_str());
-
-            input_file.read(reinterpret_cast<char*>(&width), sizeof(width));
-            input_file.read(reinterpret_cast<char*>(&height), sizeof(height));
-            canvas = new Pixel[width * height];
-
-            uchar r,g,b,fg_r,fg_g,fg_b;
-            PixelCode code;
-            char buf[3] = {0};
-
-            for (int i = 0; i < width * height; i++) {
-                input_file.read(reinterpret_cast<char*>(&r), 1);
-                input_file.read(reinterpret_cast<char*>(&g), 1);
-                input_file.read(reinterpret_cast<char*>(&b), 1);
-                input_file.read(reinterpret_cast<char*>(&fg_r), 1);
-                input_file.read(reinterpret_cast<char*>(&fg_g), 1);
-                input_file.read(reinterpret_cast<char*>(&fg_b), 1);
-                input_file.read(reinterpret_cast<char*>(&code), sizeof(code));
-                input_file.read(buf, 2);
-                canvas[i] = Pixel(r,g,b,fg_r,fg_g,fg_b,std::string(buf),code);
+            // Canonical decoding one bit at a time for long codes
+            int code = 0;
+            int first = 0;
+            int index = 0;
+            for (uint len = 1; len < 16; len++) {
+                code |= get_bits(1);
+                int count = h.count[len];
+                if (code - count < first) return h.symbols[index + (code - first)];
+                index += count;
+                first += count;
+                first <<= 1;
+                code <<= 1;
             }
-
-            for (int i = 0; i < height; i++) update_lines.insert(i);
+            throw std::invalid_argument("Invalid Huffman code");
         }
 
-        ~Canvas() {
-            delete[] canvas;
-            for (int i = 0; i < past_canvases.size(); i++) delete[] past_canvases[i].canvas;
+        void fixed_tables() {
+            uchar lengths[320];
+            for (uint i = 0; i < 144; i++) lengths[i] = 8;
+            for (uint i = 144; i < 256; i++) lengths[i] = 9;
+            for (uint i = 256; i < 280; i++) lengths[i] = 7;
+            for (uint i = 280; i < 288; i++) lengths[i] = 8;
+            lit.build(lengths, 288);
+            for (uint i = 0; i < 30; i++) lengths[i] = 5;
+            dist.build(lengths, 30);
         }
 
-        uint get_width() { return width; }
-        uint get_height() { return height; }
-
-        void save(std::string file) {
-            std::ofstream output_file;
-            output_file.open(file, std::ios::binary | std::ios::out | std::ios::trunc);
-
-            output_file << version_no << '\0';
-
-            output_file.write(reinterpret_cast<char*>(&width), sizeof(width));
-            output_file.write(reinterpret_cast<char*>(&height), sizeof(height));
-
-            for (int i = 0; i < width * height; i++) {
-                output_file << canvas[i].r << canvas[i].g << canvas[i].b << canvas[i].fg_r << canvas[i].fg_g << canvas[i].fg_b;
-                output_file.write(reinterpret_cast<char*>(&canvas[i].code), sizeof(canvas[i].code));
-                output_file.write(canvas[i].text.c_str(), 2);
+        void dynamic_tables() {
+            static const uchar order[19] = {16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15};
+            uchar lengths[320] = {0};
+            uint hlit = get_bits(5) + 257;
+            uint hdist = get_bits(5) + 1;
+            uint hclen = get_bits(4) + 4;
+
+            for (uint i = 0; i < hclen; i++) lengths[order[i]] = get_bits(3);
+            Huffman lengths_code;
+            lengths_code.build(lengths, 19);
+
+            uint n = 0;
+            std::fill(lengths, lengths + 320, 0);
+            while (n < hlit + hdist) {
+                uint sym = decode(lengths_code);
+                if (sym < 16) lengths[n++] = sym;
+                else {
+                    uint repeat;
+                    uchar value = 0;
+                    if (sym == 16) {
+                        if (n == 0) throw std::invalid_argument("Invalid code lengths");
+                        value = lengths[n - 1];
+                        repeat = 3 + get_bits(2);
+                    } else if (sym == 17) repeat = 3 + get_bits(3);
+                    else repeat = 11 + get_bits(7);
+                    if (n + repeat > hlit + hdist) throw std::invalid_argument("Invalid code lengths");
+                    while (repeat--) lengths[n++] = value;
+                }
             }
 
-            output_file.close();
+            lit.build(lengths, hlit);
+            dist.build(lengths + hlit, hdist);
         }
 
-        void save_old() {
-            Pixel* old_canvas = new Pixel[width * height];
-            for (int i = 0; i < width * height; i++) old_canvas[i] = canvas[i];
-            past_canvases.push_back(CanvasHolder(old_canvas, width, height));
+        void emit(uchar* out, size_t& produced, uchar c) {
+            window[window_pos++ & (WINDOW - 1)] = c;
+            out[produced++] = c;
         }
 
-        void undo(int times = 1) {
-            CanvasHolder holder(NULL, 0,0);
+    public:
+        Inflater(std::function<size_t(const uchar*&)> source) :
+            source{source}, in{NULL}, in_end{NULL}, ended{false}, bits{0}, bit_count{0}, state{ZLIB_HEADER}, last_block{false},
+            stored_left{0}, copy_len{0}, copy_dist{0}, window(WINDOW), window_pos{0}
+            {}
 
-            for (int i = 0; i < height; i++) update_lines.insert(i);
+        /* Fills out with up to n decompressed bytes, returning fewer only at the end of the stream. */
+        size_t read(uchar* out, size_t n) {
+            static const ushort len_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+            static const uchar len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+            static const ushort dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+            static const uchar dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
-            for (int i = 0; i < times; i++) {
-                if (past_canvases.empty()) break;
-                if (holder.canvas != NULL)
-                    delete[] holder.canvas;
-                holder = past_canvases.back();
-                past_canvases.pop_back();
+            size_t produced = 0;
+
+            while (produced < n) {
+                if (copy_len > 0) {
+                    for (; copy_len > 0 && produced < n; copy_len--)
+                        emit(out, produced, window[(window_pos - copy_dist) & (WINDOW - 1)]);
+                    continue;
+                }
+
+                switch (state) {
+                    case ZLIB_HEADER: {
+                        uint cmf = get_bits(8);
+                        uint flg = get_bits(8);
+                        if ((cmf & 15) != 8 || ((cmf << 8) | flg) % 31 != 0 || (flg & 32))
+                            throw std::invalid_argument("Invalid zlib header");
+                        state = BLOCK_HEADER;
+                        break;
+                    }
+                    case BLOCK_HEADER: {
+                        if (last_block) {
+                            state = DONE;
+                            break;
+                        }
+                        last_block = get_bits(1);
+                        uint type = get_bits(2);
+                        if (type == 0) {
+                            get_bits(bit_count % 8);
+                            uint len = get_bits(16);
+                            uint nlen = get_bits(16);
+                            if ((len ^ 0xffff) != nlen) throw std::invalid_argument("Invalid stored block");
+                            stored_left = len;
+                            state = STORED;
+                        } else if (type == 1) {
+                            fixed_tables();
+                            state = COMPRESSED;
+                        } else if (type == 2) {
+                            dynamic_tables();
+                            state = COMPRESSED;
+                        } else throw std::invalid_argument("Invalid block type");
+                        break;
+                    }
+                    case STORED: {
+                        for (; stored_left > 0 && produced < n; stored_left--)
+                            emit(out, produced, get_bits(8));
+                        if (stored_left == 0) state = BLOCK_HEADER;
+                        break;
+                    }
+                    case COMPRESSED: {
+                        uint sym = decode(lit);
+                        if (sym < 256) emit(out, produced, sym);
+                        else if (sym == 256) state = BLOCK_HEADER;
+                        else {
+                            sym -= 257;
+                            if (sym >= 29) throw std::invalid_argument("Invalid length code");
+                            copy_len = len_base[sym] + get_bits(len_extra[sym]);
+                            uint d = decode(dist);
+                            if (d >= 30) throw std::invalid_argument("Invalid distance code");
+                            copy_dist = dist_base[d] + get_bits(dist_extra[d]);
+                            if (copy_dist > window_pos) throw std::invalid_argument("Invalid distance");
+                        }
+                        break;
+                    }
+                    case DONE: return produced;
+                }
+            }
+
+            return produced;
+        }
+};
+
+/* Reads non-interlaced PNG files of any color type and bit depth. Chunk CRCs are not verified. */
+class PngReader : public ImageReader {
+    private:
+        std::ifstream input_file;
+        uint width;
+        uint height;
+        uchar depth;
+        uchar color_type;
+        uint channels;
+        uint bpp;           // Bytes per complete pixel, used by the filters
+        size_t row_bytes;
+        std::vector<uchar> prev;
+        std::vector<uchar> curr;
+        std::vector<uchar> palette;
+        std::vector<uchar> palette_alpha;
+        int trns[3];
+        bool has_trns;
+
+        uint idat_left;
+        std::vector<uchar> idat_buf;
+        Inflater inflater;
+
+        uint read_uint() {
+            uchar b[4];
+            input_file.read(reinterpret_cast<char*>(b), 4);
+            return (b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+        }
+
+        /* Supplies the inflater with the contents of consecutive IDAT chunks. */
+        size_t next_idat(const uchar*& data) {
+            while (idat_left == 0) {
+                input_file.ignore(4);
+                uint len = read_uint();
+                char type[4];
+                input_file.read(type, 4);
+                if (std::string(type, 4) != "IDAT") return 0;
+                idat_left = len;
+            }
+
+            size_t n = std::min((size_t)idat_left, idat_buf.size());
+            input_file.read(reinterpret_cast<char*>(idat_buf.data()), n);
+            idat_left -= n;
+            data = idat_buf.data();
+            return n;
+        }
+
+        uint sample(const uchar* row, uint i) {
+            if (depth == 8) return row[i];
+            if (depth == 16) return row[2 * i];
+            uint per_byte = 8 / depth;
+            uint shift = 8 - depth * (i % per_byte + 1);
+            return (row[i / per_byte] >> shift) & ((1 << depth) - 1);
+        }
+
+        uint sample16(const uchar* row, uint i) {
+            if (depth == 16) return (row[2 * i] << 8) | row[2 * i + 1];
+            return sample(row, i);
+        }
+
+    public:
+        PngReader(std::string filename) : inflater([this](const uchar*& data) { return next_idat(data); }) {
+            input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            input_file.open(filename, std::ios::binary | std::ios::in);
+
+            char signature[8];
+            input_file.read(signature, 8);
+            if (std::string(signature, 8) != "\x89PNG\r\n\x1a\n") throw std::invalid_argument(std::format("{} is not a PNG file", filename).c_str());
+
+            has_trns = false;
+            idat_left = 0;
+            idat_buf.resize(1 << 16);
+
+            bool first = true;
+            while (true) {
+                uint len = read_uint();
+                char type_buf[4];
+                input_file.read(type_buf, 4);
+                std::string type(type_buf, 4);
+
+                if (first && type != "IHDR") throw std::invalid_argument(std::format("{} does not begin with IHDR", filename).c_str());
+                first = false;
+
+                if (type == "IDAT") {
+                    idat_left = len;
+                    break;
+                } else if (type == "IHDR") {
+                    width = read_uint();
+                    height = read_uint();
+                    uchar hdr[5];
+                    input_file.read(reinterpret_cast<char*>(hdr), 5);
+                    depth = hdr[0];
+                    color_type = hdr[1];
+                    if (hdr[4] != 0) throw std::invalid_argument("Interlaced PNG files are not supported");
+                    if (hdr[2] != 0 || hdr[3] != 0) throw std::invalid_argument("Unsupported PNG compression or filter method");
+                    switch (color_type) {
+                        case 0: channels = 1; break;
+                        case 2: channels = 3; break;
+                        case 3: channels = 1; break;
+                        case 4: channels = 2; break;
+                        case 6: channels = 4; break;
+                        default: throw std::invalid_argument("Invalid PNG color type");
+                    }
+                    if (width == 0 || height == 0 || depth == 0 || depth > 16 || (depth & (depth - 1)))
+                        throw std::invalid_argument("Invalid PNG header");
+                    row_bytes = ((size_t)width * channels * depth + 7) / 8;
+                    bpp = std::max(1u, channels * depth / 8);
+                } else if (type == "PLTE") {
+                    palette.resize(len);
+                    input_file.read(reinterpret_cast<char*>(palette.data()), len);
+                } else if (type == "tRNS") {
+                    std::vector<uchar> data(len);
+                    input_file.read(reinterpret_cast<char*>(data.data()), len);
+                    has_trns = true;
+                    if (color_type == 3) palette_alpha = data;
+                    else for (uint i = 0; i < 3 && 2 * i + 1 < len; i++) trns[i] = (data[2 * i] << 8) | data[2 * i + 1];
+                } else input_file.ignore(len);
+
+                if (type != "IDAT") input_file.ignore(4);
+            }
+
+            prev.assign(row_bytes, 0);
+            curr.assign(row_bytes, 0);
+        }
+
+        uint get_width() override { return width; }
+        uint get_height() override { return height; }
+
+        void read_row(uchar* rgba) override {
+            uchar filter;
+            if (inflater.read(&filter, 1) != 1 || inflater.read(curr.data(), row_bytes) != row_bytes)
+                throw std::invalid_argument("PNG image data ended early");
+
+            uchar* c = curr.data();
+            const uchar* p = prev.data();
+            switch (filter) {
+                case 0: break;
+                case 1: for (size_t i = bpp; i < row_bytes; i++) c[i] += c[i - bpp]; break;
+                case 2: for (size_t i = 0; i < row_bytes; i++) c[i] += p[i]; break;
+                case 3:
+                    for (size_t i = 0; i < row_bytes; i++) c[i] += ((i >= bpp ? c[i - bpp] : 0) + p[i]) / 2;
+                    break;
+                case 4:
+                    for (size_t i = 0; i < row_bytes; i++) {
+                        int a = i >= bpp ? c[i - bpp] : 0;
+                        int b = p[i];
+                        int cc = i >= bpp ? p[i - bpp] : 0;
+                        int pa = std::abs(b - cc);
+                        int pb = std::abs(a - cc);
+                        int pc = std::abs(a + b - 2 * cc);
+                        c[i] += (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : cc);
+                    }
+                    break;
+                default: throw std::invalid_argument("Invalid PNG filter");
+            }
+
+            uint scale = depth < 8 ? 255 / ((1 << depth) - 1) : 1;
+            for (uint i = 0; i < width; i++) {
+                uchar* o = rgba + 4 * i;
+                switch (color_type) {
+                    case 0: {
+                        o[0] = o[1] = o[2] = sample(c, i) * scale;
+                        o[3] = (has_trns && sample16(c, i) == trns[0]) ? 0 : 255;
+                        break;
+                    }
+                    case 2: {
+                        for (uint k = 0; k < 3; k++) o[k] = sample(c, 3 * i + k);
+                        o[3] = (has_trns && sample16(c, 3 * i) == trns[0] && sample16(c, 3 * i + 1) == trns[1] && sample16(c, 3 * i + 2) == trns[2]) ? 0 : 255;
+                        break;
+                    }
+                    case 3: {
+                        uint index = sample(c, i);
+                        if (3 * index + 2 >= palette.size()) throw std::invalid_argument("Invalid PNG palette index");
+                        for (uint k = 0; k < 3; k++) o[k] = palette[3 * index + k];
+                        o[3] = index < palette_alpha.size() ? palette_alpha[index] : 255;
+                        break;
+                    }
+                    case 4: {
+                        o[0] = o[1] = o[2] = sample(c, 2 * i);
+                        o[3] = sample(c, 2 * i + 1);
+                        break;
+                    }
+                    case 6: {
+                        for (uint k = 0; k < 4; k++) o[k] = sample(c, 4 * i + k);
+                        break;
+                    }
+                }
+            }
+
+            std::swap(prev, curr);
+        }
+};
+
+std::unique_ptr<ImageReader> open_image(std::string filename) {
+    std::ifstream input_file;
+    input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+    input_file.open(filename, std::ios::binary | std::ios::in);
+
+    char magic[2];
+    input_file.read(magic, 2);
+    input_file.close();
+
+    if (magic[0] == '\x89' && magic[1] == 'P') return std::make_unique<PngReader>(filename);
+    if (magic[0] == 'P') return std::make_unique<PnmReader>(filename);
+    throw std::invalid_argument(std::format("Unknown image format in {}", filename).c_str());
+}
+
+/* Images are also written one RGBA row at a time. */
+class ImageWriter {
+    public:
+        virtual ~ImageWriter() {}
+        virtual void write_row(const uchar* rgba) =0;
+        virtual void finish() {}
+};
+
+/* Writes binary PPM files. PPM has no transparency, so transparent pixels are written as white. */
+class PpmWriter : public ImageWriter {
+    private:
+        std::ofstream output_file;
+        uint width;
+        std::vector<uchar> buf;
+
+    public:
+        PpmWriter(std::string filename, uint width, uint height) : width{width}, buf(3 * width) {
+            output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            output_file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+            output_file << std::format("P6\n{} {}\n255\n", width, height);
+        }
+
+        void write_row(const uchar* rgba) override {
+            for (uint i = 0; i < width; i++) {
+                bool trans = rgba[4 * i + 3] == 0;
+                for (uint k = 0; k < 3; k++) buf[3 * i + k] = trans ? 255 : rgba[4 * i + k];
+            }
+            output_file.write(reinterpret_cast<char*>(buf.data()), buf.size());
+        }
+
+        void finish() override {
+            output_file.close();
+        }
+};
+
+uint crc32(uint crc, const uchar* data, size_t n) {
+    static uint table[256] = {0};
+    if (table[1] == 0) {
+        for (uint i = 0; i < 256; i++) {
+            uint c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < n; i++) crc = table[(crc ^ data[i]) & 255] ^ (crc >> 8);
+    return ~crc;
+}
+
+/* Compresses a zlib stream incrementally, either into stored blocks or with greedy LZ77 matching coded in a single
+ * block of fixed Huffman codes. Compressed output is handed to sink in pieces. */
+class Deflater {
+    private:
+        static const uint WINDOW = 1 << 15;
+        static const uint HASH_BITS = 15;
+        static const uint MIN_MATCH = 3;
+        static const uint MAX_MATCH = 258;
+        static const uint STORED_BLOCK = 65535;
+
+        std::function<void(const uchar*, size_t)> sink;
+        bool stored;
+        std::vector<uchar> buf;     // The window followed by the input which hasn't been compressed yet
+        size_t base;                // The position of buf[0] in the input
+        size_t pos;                 // The next byte of buf to compress
+        std::vector<size_t> head;   // The last position in the input of every hash
+        uint adler_a;
+        uint adler_b;
+        unsigned long long bits;
+        uint bit_count;
+        std::vector<uchar> out;
+
+        void put_bits(uint value, uint n) {
+            bits |= (unsigned long long)value << bit_count;
+            bit_count += n;
+            while (bit_count >= 8) {
+                out.push_back(bits & 255);
+                bits >>= 8;
+                bit_count -= 8;
+            }
+        }
+
+        void align() {
+            if (bit_count > 0) put_bits(0, 8 - bit_count);
+        }
+
+        void flush_out() {
+            if (out.size() < (1 << 16)) return;
+            sink(out.data(), out.size());
+            out.clear();
+        }
+
+        /* Fixed Huffman codes are written most significant bit first, so they are stored reversed. */
+        static uint reverse(uint code, uint len) {
+            uint r = 0;
+            for (uint i = 0; i < len; i++) r |= ((code >> i) & 1) << (len - 1 - i);
+            return r;
+        }
+
+        void put_symbol(uint sym) {
+            if (sym < 144) put_bits(reverse(0x30 + sym, 8), 8);
+            else if (sym < 256) put_bits(reverse(0x190 + sym - 144, 9), 9);
+            else if (sym < 280) put_bits(reverse(sym - 256, 7), 7);
+            else put_bits(reverse(0xc0 + sym - 280, 8), 8);
+        }
+
+        void put_match(uint len, uint dist) {
+            static const ushort len_base[29] = {3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258};
+            static const uchar len_extra[29] = {0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0};
+            static const ushort dist_base[30] = {1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577};
+            static const uchar dist_extra[30] = {0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+            uint l = std::upper_bound(len_base, len_base + 29, len) - len_base - 1;
+            put_symbol(257 + l);
+            put_bits(len - len_base[l], len_extra[l]);
+
+            uint d = std::upper_bound(dist_base, dist_base + 30, dist) - dist_base - 1;
+            put_bits(reverse(d, 5), 5);
+            put_bits(dist - dist_base[d], dist_extra[d]);
+        }
+
+        uint hash(size_t i) {
+            return ((buf[i] << 16 | buf[i + 1] << 8 | buf[i + 2]) * 2654435761u) >> (32 - HASH_BITS);
+        }
+
+        void put_stored(size_t n, bool last) {
+            put_bits(last, 1);
+            put_bits(0, 2);
+            align();
+            put_bits(n, 16);
+            put_bits(n ^ 0xffff, 16);
+            out.insert(out.end(), buf.begin() + pos, buf.begin() + pos + n);
+            pos += n;
+        }
+
+        void compress(bool last) {
+            if (stored) {
+                while (buf.size() - pos >= STORED_BLOCK) {
+                    put_stored(STORED_BLOCK, false);
+                    flush_out();
+                }
+                if (last) put_stored(buf.size() - pos, true);
+            } else {
+                size_t end = last ? buf.size() : buf.size() - std::min(buf.size(), (size_t)MAX_MATCH);
+                while (pos < end) {
+                    uint len = 0;
+                    size_t dist = 0;
+
+                    if (pos + MIN_MATCH <= buf.size()) {
+                        uint h = hash(pos);
+                        size_t cand = head[h];
+                        head[h] = base + pos;
+
+                        if (cand != (size_t)-1 && cand >= base && base + pos - cand <= WINDOW) {
+                            size_t c = cand - base;
+                            size_t max = std::min((size_t)MAX_MATCH, buf.size() - pos);
+                            while (len < max && buf[c + len] == buf[pos + len]) len++;
+                            dist = pos - c;
+                        }
+                    }
+
+                    if (len >= MIN_MATCH) {
+                        put_match(len, dist);
+                        for (size_t i = pos + 1; i < pos + len && i + MIN_MATCH <= buf.size(); i++) head[hash(i)] = base + i;
+                        pos += len;
+                    } else {
+                        put_symbol(buf[pos]);
+                        pos++;
+                    }
+                }
+                if (last) put_symbol(256);
+            }
+
+            if (pos > 2 * WINDOW) { // Only keep the window which matches may refer to
+                size_t drop = pos - WINDOW;
+                buf.erase(buf.begin(), buf.begin() + drop);
+                base += drop;
+                pos -= drop;
+            }
+        }
+
+    public:
+        Deflater(std::function<void(const uchar*, size_t)> sink, bool stored = false) :
+            sink{sink}, stored{stored}, base{0}, pos{0}, adler_a{1}, adler_b{0}, bits{0}, bit_count{0}
+        {
+            if (!stored) head.assign(1 << HASH_BITS, -1);
+            put_bits(0x78, 8);
+            put_bits(0x01, 8);
+            if (!stored) {
+                put_bits(1, 1);     // A single final block of fixed codes
+                put_bits(1, 2);
+            }
+        }
+
+        void write(const uchar* data, size_t n) {
+            for (size_t i = 0; i < n; i++) {
+                adler_a = (adler_a + data[i]) % 65521;
+                adler_b = (adler_b + adler_a) % 65521;
+            }
+
+            buf.insert(buf.end(), data, data + n);
+            compress(false);
+            flush_out();
+        }
+
+        void finish() {
+            compress(true);
+            align();
+            uint adler = (adler_b << 16) | adler_a;
+            for (int i = 24; i >= 0; i -= 8) put_bits((adler >> i) & 255, 8);
+            sink(out.data(), out.size());
+            out.clear();
+        }
+};
+
+/* Writes RGBA PNG files. Rows identical to the previous one use the Up filter, which makes them compress to almost
+ * nothing, and every other row uses the Sub filter. */
+class PngWriter : public ImageWriter {
+    private:
+        std::ofstream output_file;
+        uint width;
+        uint height;
+        std::vector<uchar> prev;
+        std::vector<uchar> filtered;
+        bool first;
+        Deflater deflater;
+
+        void write_chunk(std::string type, const uchar* data, size_t n) {
+            uchar len[4] = {(uchar)(n >> 24), (uchar)(n >> 16), (uchar)(n >> 8), (uchar)n};
+            uint crc = crc32(crc32(0, reinterpret_cast<const uchar*>(type.data()), 4), data, n);
+            uchar crc_bytes[4] = {(uchar)(crc >> 24), (uchar)(crc >> 16), (uchar)(crc >> 8), (uchar)crc};
+
+            output_file.write(reinterpret_cast<char*>(len), 4);
+            output_file.write(type.data(), 4);
+            output_file.write(reinterpret_cast<const char*>(data), n);
+            output_file.write(reinterpret_cast<char*>(crc_bytes), 4);
+        }
+
+    public:
+        PngWriter(std::string filename, uint width, uint height, bool stored = false) :
+            width{width}, height{height}, prev(4 * width), filtered(4 * width + 1), first{true},
+            deflater([this](const uchar* data, size_t n) { if (n > 0) write_chunk("IDAT", data, n); }, stored)
+        {
+            output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            output_file.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+            output_file.write("\x89PNG\r\n\x1a\n", 8);
+
+            uchar ihdr[13] = {(uchar)(width >> 24), (uchar)(width >> 16), (uchar)(width >> 8), (uchar)width,
+                              (uchar)(height >> 24), (uchar)(height >> 16), (uchar)(height >> 8), (uchar)height, 8, 6, 0, 0, 0};
+            write_chunk("IHDR", ihdr, 13);
+        }
+
+        void write_row(const uchar* rgba) override {
+            size_t n = 4 * width;
+
+            if (!first && std::equal(rgba, rgba + n, prev.begin())) {
+                filtered[0] = 2;
+                std::fill(filtered.begin() + 1, filtered.end(), 0);
+            } else {
+                filtered[0] = 1;
+                for (size_t i = 0; i < n; i++) filtered[i + 1] = rgba[i] - (i >= 4 ? rgba[i - 4] : 0);
+                std::copy(rgba, rgba + n, prev.begin());
+            }
+
+            first = false;
+            deflater.write(filtered.data(), filtered.size());
+        }
+
+        void finish() override {
+            deflater.finish();
+            write_chunk("IEND", NULL, 0);
+            output_file.close();
+        }
+};
+
+/* Coefficients for resampling a line of src samples into dst samples. Destination sample i is the weighted sum of
+ * the taps from start[i] to start[i + 1]. */
+struct ResampleTable {
+    std::vector<uint> start;
+    std::vector<uint> index;
+    std::vector<float> weight;
+
+    /* Every destination sample averages the source samples it covers, weighted by how much of each is covered. */
+    static ResampleTable area(uint src, uint dst) {
+        ResampleTable t;
+        double scale = (double)src / dst;
+
+        for (uint i = 0; i < dst; i++) {
+            t.start.push_back(t.index.size());
+            double b = i * scale;
+            double e = (i + 1) * scale;
+            for (uint j = std::floor(b); j < e && j < src; j++) {
+                double w = std::min(e, j + 1.) - std::max(b, (double)j);
+                if (w <= 0) continue;
+                t.index.push_back(j);
+                t.weight.push_back(w / scale);
+            }
+        }
+        t.start.push_back(t.index.size());
+
+        return t;
+    }
+
+    /* Every destination sample is the source sample under its center. */
+    static ResampleTable nearest(uint src, uint dst) {
+        ResampleTable t;
+        for (uint i = 0; i < dst; i++) {
+            t.start.push_back(i);
+            t.index.push_back(std::min<uint>((i + .5) * src / dst, src - 1));
+            t.weight.push_back(1);
+        }
+        t.start.push_back(dst);
+        return t;
+    }
+
+    /* Every destination sample interpolates between the two source samples nearest to its center. */
+    static ResampleTable bilinear(uint src, uint dst) {
+        ResampleTable t;
+        for (uint i = 0; i < dst; i++) {
+            t.start.push_back(t.index.size());
+            double x = std::clamp((i + .5) * src / dst - .5, 0., src - 1.);
+            uint j = x;
+            double w = x - j;
+            t.index.push_back(j);
+            t.weight.push_back(1 - w);
+            if (w > 0) {
+                t.index.push_back(j + 1);
+                t.weight.push_back(w);
+            }
+        }
+        t.start.push_back(t.index.size());
+        return t;
+    }
+};
+
+enum ScaleMode { SCALE_NEAREST, SCALE_BILINEAR, SCALE_AREA };
+
+/* Writes a file through a temporary file next to it, which is synced to disk and renamed over the original, so
+ * the original is never left half written. */
+void write_atomically(const std::string& filename, const std::function<void(std::ostream&)>& write) {
+    static std::atomic<uint> counter = 0;
+
+    std::ostringstream buffer;
+    write(buffer);
+    std::string data = std::move(buffer).str();
+
+    std::string temp = std::format("{}.{}.{}.tmp", filename, getpid(), counter++);
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) throw std::invalid_argument(std::format("Can't create {}: {}", temp, std::strerror(errno)).c_str());
+
+    auto fail = [&](std::string what) {
+        std::string err = std::strerror(errno);
+        if (fd >= 0) close(fd);
+        unlink(temp.c_str());
+        throw std::invalid_argument(std::format("Can't {} {}: {}", what, temp, err).c_str());
+    };
+
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) fail("write");
+        done += n;
+    }
+    if (fsync(fd) != 0) fail("sync");
+    int closed = close(fd);
+    fd = -1;
+    if (closed != 0) fail("close");
+    if (rename(temp.c_str(), filename.c_str()) != 0) fail("rename");
+
+    // Make the rename itself durable
+    size_t slash = filename.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : filename.substr(0, slash + 1);
+    int dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+}
+
+/* A bounded queue between one producer thread and one consumer thread, which never takes a lock. */
+template <typename T, uint N>
+class SpscQueue {
+    private:
+        T items[N];
+        std::atomic<uint> head; // Only written by the consumer
+        std::atomic<uint> tail; // Only written by the producer
+
+    public:
+        SpscQueue() : head{0}, tail{0} {}
+
+        bool push(T& item) {
+            uint t = tail.load(std::memory_order_relaxed);
+            if (t - head.load(std::memory_order_acquire) == N) return false;
+            items[t % N] = std::move(item);
+            tail.store(t + 1, std::memory_order_release);
+            tail.notify_one();
+            return true;
+        }
+
+        bool pop(T& item) {
+            uint h = head.load(std::memory_order_relaxed);
+            if (h == tail.load(std::memory_order_acquire)) return false;
+            item = std::move(items[h % N]);
+            head.store(h + 1, std::memory_order_release);
+            return true;
+        }
+
+        bool empty() { return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire); }
+
+        /* Blocks the consumer until there is something to pop. */
+        void wait() { tail.wait(head.load(std::memory_order_relaxed), std::memory_order_acquire); }
+};
+
+/* Writes the editor's output to the terminal from a separate thread, so input is never held up by a slow
+ * terminal. Output is presented as frames of chunks. A chunk with a key covers a fixed area of the screen, so if
+ * the thread falls behind only the latest chunk for every key is written. Until the thread is started, output
+ * is written directly. */
+class Screen {
+    public:
+        struct Chunk {
+            uint key;
+            std::string bytes;
+        };
+
+        typedef std::vector<Chunk> Frame;
+
+        static const uint UNKEYED = 0;
+        static const uint CURSOR = 1;
+        static const uint STATUS = 2;
+        static const uint CANVAS_ROW = 16; // Plus the row of the screen
+
+    private:
+        static SpscQueue<Frame, 64> queue;
+        static Frame frame;   // Being built by the input thread
+        static Frame backlog; // Presented, but didn't fit in the queue yet
+        static std::thread thread;
+        static std::atomic<bool> stopping;
+
+        static void coalesce(Frame& f) {
+            std::unordered_map<uint, size_t> last;
+            for (size_t i = 0; i < f.size(); i++) if (f[i].key != UNKEYED) last[f[i].key] = i;
+
+            Frame kept;
+            for (size_t i = 0; i < f.size(); i++)
+                if (f[i].key == UNKEYED || last[f[i].key] == i) kept.push_back(std::move(f[i]));
+            f = std::move(kept);
+        }
+
+        static void write_all(const std::string& s) {
+            size_t done = 0;
+            while (done < s.size()) {
+                ssize_t n = ::write(STDOUT_FILENO, s.data() + done, s.size() - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return;
+                done += n;
+            }
+        }
+
+        static void run() {
+            Frame f;
+            Frame batch;
+            std::string out;
+
+            while (true) {
+                queue.wait();
+                while (queue.pop(f)) {
+                    for (Chunk& c : f) batch.push_back(std::move(c));
+                    f.clear();
+                }
+                coalesce(batch);
+
+                out.clear();
+                for (const Chunk& c : batch) out += c.bytes;
+                write_all(out);
+                batch.clear();
+
+                if (stopping && queue.empty()) return;
+            }
+        }
+
+    public:
+        static void write(std::string bytes, uint key = UNKEYED) {
+            if (!thread.joinable()) std::cout << bytes;
+            else frame.push_back(Chunk{key, std::move(bytes)});
+        }
+
+        /* Hands the current frame to the thread. Returns false if the queue is full, in which case the frame is
+         * kept and merged with the next one. */
+        static bool present() {
+            if (!thread.joinable()) {
+                std::cout << std::flush;
+                return true;
+            }
+
+            for (Chunk& c : frame) backlog.push_back(std::move(c));
+            frame.clear();
+            if (backlog.empty()) return true;
+            if (backlog.size() > 4096) coalesce(backlog);
+            if (!queue.push(backlog)) return false;
+            backlog.clear();
+            return true;
+        }
+
+        static bool pending() { return !backlog.empty(); }
+
+        static void start() {
+            std::cout << std::flush;
+            stopping = false;
+            thread = std::thread(run);
+        }
+
+        /* Writes everything which is still queued and stops the thread. */
+        static void stop() {
+            if (!thread.joinable()) return;
+            while (!present()) std::this_thread::yield();
+
+            stopping = true;
+            Frame last;
+            while (!queue.push(last)) std::this_thread::yield(); // Wakes the thread if it is waiting
+            thread.join();
+        }
+};
+
+SpscQueue<Screen::Frame, 64> Screen::queue;
+Screen::Frame Screen::frame;
+Screen::Frame Screen::backlog;
+std::thread Screen::thread;
+std::atomic<bool> Screen::stopping;
+
+/* Four ints, operated on together with SSE (or NEON) instructions. */
+typedef int v4i __attribute__((vector_size(16)));
+
+enum AdjustOp { ADJUST_INVERT, ADJUST_GRAYSCALE, ADJUST_BRIGHTNESS, ADJUST_CONTRAST, ADJUST_HUE, ADJUST_SWAP, ADJUST_REMAP };
+
+/* A transformation of colors. It runs on the red, green and blue channels of many pixels at once, each kept in an
+ * array of its own, four values at a time. */
+struct ColorAdjustment {
+    AdjustOp op;
+    std::vector<int> args;
+
+    /* Parses an adjustment from the words in strs, beginning with its name. */
+    ColorAdjustment(const std::vector<std::string>& strs) {
+        if (strs.empty()) throw std::invalid_argument("Must provide an adjustment");
+        std::string name = strs[0];
+        for (uint i = 1; i < strs.size(); i++) {
+            if (name == "swap") continue;
+            args.push_back(std::stoi(strs[i]));
+        }
+
+        uint count = 0;
+        if (name == "invert") op = ADJUST_INVERT;
+        else if (name == "grayscale") op = ADJUST_GRAYSCALE;
+        else if (name == "brightness") op = ADJUST_BRIGHTNESS, count = 1;
+        else if (name == "contrast") op = ADJUST_CONTRAST, count = 1;
+        else if (name == "hue") op = ADJUST_HUE, count = 1;
+        else if (name == "swap") {
+            op = ADJUST_SWAP;
+            std::string order = strs.size() > 1 ? strs[1] : "";
+            std::string sorted = order;
+            std::sort(sorted.begin(), sorted.end());
+            if (sorted != "bgr") throw std::invalid_argument(std::format("Invalid channel order {}", order).c_str());
+            for (char c : order) args.push_back(c == 'r' ? 0 : c == 'g' ? 1 : 2);
+            count = 3;
+        } else if (name == "remap") {
+            op = ADJUST_REMAP;
+            if (args.empty() || args.size() % 6 != 0) throw std::invalid_argument("remap needs pairs of colors");
+            count = args.size();
+        } else throw std::invalid_argument(std::format("Invalid adjustment {}", name).c_str());
+
+        if (args.size() != count) throw std::invalid_argument(std::format("Wrong number of arguments to {}", name).c_str());
+    }
+
+    /* Adjusts n colors, where n is a multiple of 4. */
+    void apply(int* r, int* g, int* b, uint n) const {
+        const v4i zero = {};
+        const v4i max = zero + 255;
+        auto clamp = [&](v4i v) { v = v < zero ? zero : v; return v > max ? max : v; };
+
+        int m[9] = {}; // A fixed point matrix for hue rotations
+        if (op == ADJUST_HUE) {
+            double a = args[0] * M_PI / 180, c = std::cos(a), s = std::sin(a);
+            double h[9] = {.213 + c * .787 - s * .213, .715 - c * .715 - s * .715, .072 - c * .072 + s * .928,
+                           .213 - c * .213 + s * .143, .715 + c * .285 + s * .140, .072 - c * .072 - s * .283,
+                           .213 - c * .213 - s * .787, .715 - c * .715 + s * .715, .072 + c * .928 + s * .072};
+            for (uint i = 0; i < 9; i++) m[i] = std::lround(h[i] * 1024);
+        }
+
+        for (uint i = 0; i < n; i += 4) {
+            v4i vr, vg, vb;
+            std::memcpy(&vr, r + i, sizeof(vr));
+            std::memcpy(&vg, g + i, sizeof(vg));
+            std::memcpy(&vb, b + i, sizeof(vb));
+
+            switch (op) {
+                case ADJUST_INVERT:
+                    vr = max - vr;
+                    vg = max - vg;
+                    vb = max - vb;
+                    break;
+                case ADJUST_GRAYSCALE:
+                    vr = vg = vb = (77 * vr + 150 * vg + 29 * vb) >> 8;
+                    break;
+                case ADJUST_BRIGHTNESS:
+                    vr = clamp(vr + args[0]);
+                    vg = clamp(vg + args[0]);
+                    vb = clamp(vb + args[0]);
+                    break;
+                case ADJUST_CONTRAST: { // args[0] is a percentage
+                    int f = args[0] * 256 / 100;
+                    vr = clamp((((vr - 128) * f) >> 8) + 128);
+                    vg = clamp((((vg - 128) * f) >> 8) + 128);
+                    vb = clamp((((vb - 128) * f) >> 8) + 128);
+                    break;
+                }
+                case ADJUST_HUE: {
+                    v4i nr = (m[0] * vr + m[1] * vg + m[2] * vb + 512) >> 10;
+                    v4i ng = (m[3] * vr + m[4] * vg + m[5] * vb + 512) >> 10;
+                    v4i nb = (m[6] * vr + m[7] * vg + m[8] * vb + 512) >> 10;
+                    vr = clamp(nr);
+                    vg = clamp(ng);
+                    vb = clamp(nb);
+                    break;
+                }
+                case ADJUST_SWAP: {
+                    v4i c[3] = {vr, vg, vb};
+                    vr = c[args[0]];
+                    vg = c[args[1]];
+                    vb = c[args[2]];
+                    break;
+                }
+                case ADJUST_REMAP: { // Every color is matched against the original colors, so pairs don't chain
+                    v4i nr = vr, ng = vg, nb = vb;
+                    for (uint k = 0; k < args.size(); k += 6) {
+                        v4i match = (vr == args[k]) & (vg == args[k + 1]) & (vb == args[k + 2]);
+                        nr = match ? zero + args[k + 3] : nr;
+                        ng = match ? zero + args[k + 4] : ng;
+                        nb = match ? zero + args[k + 5] : nb;
+                    }
+                    vr = clamp(nr);
+                    vg = clamp(ng);
+                    vb = clamp(nb);
+                    break;
+                }
+            }
+
+            std::memcpy(r + i, &vr, sizeof(vr));
+            std::memcpy(g + i, &vg, sizeof(vg));
+            std::memcpy(b + i, &vb, sizeof(vb));
+        }
+    }
+};
+
+/* A set of lines, one bit per line, so marking a line costs a store rather than an insert into a tree. Lines are
+ * iterated in order, skipping unmarked lines a word at a time. */
+class LineSet {
+    private:
+        std::vector<uint64_t> bits;
+
+    public:
+        class iterator {
+            private:
+                const LineSet* set;
+                uint i;
+
+            public:
+                iterator(const LineSet* set, uint i) : set{set}, i{i} {}
+                uint operator*() const { return i; }
+                iterator& operator++() {
+                    i = set->next(i + 1);
+                    return *this;
+                }
+                iterator operator++(int) {
+                    iterator old = *this;
+                    ++*this;
+                    return old;
+                }
+                bool operator==(const iterator& other) const { return i == other.i; }
+        };
+
+        void insert(uint i) {
+            if (i / 64 >= bits.size()) bits.resize(i / 64 + 1, 0);
+            bits[i / 64] |= 1ULL << (i % 64);
+        }
+
+        bool contains(uint i) const { return i / 64 < bits.size() && (bits[i / 64] >> (i % 64) & 1); }
+
+        void clear() { std::fill(bits.begin(), bits.end(), 0); }
+
+        bool empty() const { return next(0) == bits.size() * 64; }
+
+        /* The first line in the set from i on, or the end. */
+        uint next(uint i) const {
+            for (uint k = i / 64; k < bits.size(); k++) {
+                uint64_t w = k == i / 64 ? bits[k] & ~0ULL << (i % 64) : bits[k];
+                if (w != 0) return k * 64 + std::countr_zero(w);
+            }
+            return bits.size() * 64;
+        }
+
+        iterator begin() const { return iterator(this, next(0)); }
+        iterator end() const { return iterator(this, bits.size() * 64); }
+};
+
+enum SelectOp { SELECT_REPLACE, SELECT_ADD, SELECT_INTERSECT, SELECT_SUBTRACT };
+
+/* A set of pixels, one bit per pixel. Every row begins on a new 64 bit word, so unselected parts of a row can be
+ * skipped a word at a time. Until something is selected, every pixel is. */
+class Selection {
+    private:
+        uint width;
+        uint height;
+        uint stride; // Words per row
+        std::vector<uint64_t> bits;
+        bool everything;
+
+        /* The bits of word k which lie between columns x0 and x1. */
+        static uint64_t span_mask(uint k, uint x0, uint x1) {
+            uint64_t m = ~0ULL;
+            if (k == x0 / 64) m &= ~0ULL << (x0 % 64);
+            if (k == x1 / 64 && x1 % 64 != 63) m &= (1ULL << (x1 % 64 + 1)) - 1;
+            return m;
+        }
+
+        void select_all() {
+            everything = false;
+            for (uint y = 0; y < height; y++) set_span(y, 0, width - 1);
+        }
+
+    public:
+        Selection(uint width = 0, uint height = 0, bool everything = true) :
+            width{width}, height{height}, stride{(width + 63) / 64}, bits(stride * height, 0), everything{everything} {}
+
+        uint get_width() const { return width; }
+        uint get_height() const { return height; }
+        bool is_everything() const { return everything; }
+
+        bool contains(uint x, uint y) const {
+            return everything || (bits[y * stride + x / 64] >> (x % 64) & 1);
+        }
+
+        void set(uint x, uint y) { bits[y * stride + x / 64] |= 1ULL << (x % 64); }
+
+        void set_span(uint y, uint x0, uint x1) {
+            for (uint k = x0 / 64; k <= x1 / 64; k++) bits[y * stride + k] |= span_mask(k, x0, x1);
+        }
+
+        uint count() const {
+            if (everything) return width * height;
+            uint n = 0;
+            for (uint64_t w : bits) n += std::popcount(w);
+            return n;
+        }
+
+        /* Calls f with every selected column of row y between x0 and x1. */
+        template<typename F> void for_each(uint y, uint x0, uint x1, F f) const {
+            if (everything) {
+                for (uint x = x0; x <= x1; x++) f(x);
+                return;
+            }
+            for (uint k = x0 / 64; k <= x1 / 64; k++) {
+                uint64_t w = bits[y * stride + k] & span_mask(k, x0, x1);
+                for (; w != 0; w &= w - 1) f(k * 64 + std::countr_zero(w));
+            }
+        }
+
+        void combine(const Selection& other, SelectOp op) {
+            if (op == SELECT_REPLACE || (everything && op == SELECT_INTERSECT)) {
+                *this = other;
+                return;
+            }
+            if (everything && op == SELECT_ADD) return;
+            if (everything) select_all();
+
+            for (uint k = 0; k < bits.size(); k++) {
+                uint64_t w = other.everything ? ~0ULL : other.bits[k];
+                if (op == SELECT_ADD) bits[k] |= w;
+                else if (op == SELECT_INTERSECT) bits[k] &= w;
+                else bits[k] &= ~w;
+            }
+            if (other.everything && op == SELECT_ADD) *this = other;
+        }
+
+        static Selection rect(uint width, uint height, Point<uint> start, Point<uint> end) {
+            Selection s(width, height, false);
+            for (uint y = std::min(start.y, end.y); y <= std::min(std::max(start.y, end.y), height - 1); y++)
+                s.set_span(y, std::min(start.x, end.x), std::min(std::max(start.x, end.x), width - 1));
+            return s;
+        }
+
+        static Selection ellipse(uint width, uint height, Point<uint> p, uint rx, uint ry) {
+            Selection s(width, height, false);
+            for (int y = std::max(0, (int)p.y - (int)ry); y <= std::min((int)height - 1, (int)(p.y + ry)); y++) {
+                double dy = ry == 0 ? 0 : ((double)y - p.y) / ry;
+                int dx = std::lround(rx * std::sqrt(std::max(0., 1 - dy * dy)));
+                int x0 = std::max(0, (int)p.x - dx);
+                int x1 = std::min((int)width - 1, (int)p.x + dx);
+                if (x0 <= x1) s.set_span(y, x0, x1);
+            }
+            return s;
+        }
+
+        /* Selects the pixels whose centers lie inside the polygon, by the even-odd rule. */
+        static Selection polygon(uint width, uint height, const std::vector<Point<int>>& points) {
+            Selection s(width, height, false);
+            std::vector<double> crossings;
+            for (uint y = 0; y < height; y++) {
+                double cy = y + .5;
+                crossings.clear();
+                for (uint i = 0; i < points.size(); i++) {
+                    const Point<int>& a = points[i];
+                    const Point<int>& b = points[(i + 1) % points.size()];
+                    if ((a.y + .5 <= cy) == (b.y + .5 <= cy)) continue;
+                    crossings.push_back(a.x + (cy - a.y - .5) * (b.x - a.x) / (b.y - a.y));
+                }
+                std::sort(crossings.begin(), crossings.end());
+                for (uint i = 0; i + 1 < crossings.size(); i += 2) {
+                    int x0 = std::max(0., std::ceil(crossings[i]));
+                    int x1 = std::min(width - 1., std::floor(crossings[i + 1]));
+                    if (x0 <= x1) s.set_span(y, x0, x1);
+                }
+            }
+            return s;
+        }
+
+        /* Selects the pixels connected to seed whose colors differ from it by at most tolerance in every channel. */
+        static Selection wand(uint width, uint height, const Pixel* pixels, Point<uint> seed, uint tolerance) {
+            Selection s(width, height, false);
+            const Pixel& c = pixels[seed.y * width + seed.x];
+            auto similar = [&](const Pixel& p) {
+                if (p.code == TRANSPARENT || c.code == TRANSPARENT) return p.code == c.code;
+                return (uint)std::abs(p.r - c.r) <= tolerance && (uint)std::abs(p.g - c.g) <= tolerance && (uint)std::abs(p.b - c.b) <= tolerance;
+            };
+
+            std::vector<Point<uint>> stack = {seed};
+            s.set(seed.x, seed.y);
+            while (!stack.empty()) {
+                Point<uint> p = stack.back();
+                stack.pop_back();
+                Point<uint> next[] = {Point<uint>(p.x - 1, p.y), Point<uint>(p.x + 1, p.y), Point<uint>(p.x, p.y - 1), Point<uint>(p.x, p.y + 1)};
+                for (const Point<uint>& n : next) {
+                    if (n.x >= width || n.y >= height || s.contains(n.x, n.y) || !similar(pixels[n.y * width + n.x])) continue;
+                    s.set(n.x, n.y);
+                    stack.push_back(n);
+                }
+            }
+            return s;
+        }
+};
+
+enum BlendMode { BLEND_NORMAL, BLEND_MULTIPLY, BLEND_ADD };
+
+/* A long operation split into chunks, so the editor can keep drawing and reading keys in between them. Chunks are
+ * run in order by step, finish is called after the last one, and rollback undoes the chunks run so far if the
+ * task is cancelled instead. */
+class Task {
+    private:
+        uint chunks;
+        uint done;
+        std::function<void(uint)> chunk;
+        std::function<void()> finish;
+        std::function<void()> rollback;
+
+    public:
+        Task(uint chunks, std::function<void(uint)> chunk, std::function<void()> finish, std::function<void()> rollback) :
+            chunks{chunks}, done{0}, chunk{chunk}, finish{finish}, rollback{rollback} {}
+
+        /* Runs the next chunk, returning true once the task is finished. */
+        bool step() {
+            if (done < chunks) chunk(done++);
+            if (done < chunks) return false;
+            if (finish) finish();
+            finish = NULL;
+            return true;
+        }
+
+        double progress() const { return chunks == 0 ? 1 : (double)done / chunks; }
+        uint get_done() const { return done; }
+
+        void cancel() { if (rollback) rollback(); }
+
+        /* Runs the whole task at once and deletes it, for when nothing needs to happen in between. */
+        static void run(Task* task) {
+            while (!task->step());
+            delete task;
+        }
+};
+
+class Renderer;
+class SharedCanvas;
+
+class Canvas {
+    public:
+        /* The columns of a row between which it has content (pixels which aren't transparent). */
+        struct Extent {
+            uint first;
+            uint last;
+
+            bool empty() const { return first > last; }
+        };
+
+        struct Snapshot {
+            struct Layer {
+                std::string name;
+                bool visible;
+                uchar opacity;
+                BlendMode blend;
+                std::vector<Pixel> pixels;
+            };
+
+            uint width;
+            uint height;
+            std::vector<Pixel> pixels; // Flattened
+            std::vector<Layer> layers; // Empty if only the flattened pixels are known
+            uint active;
+            std::vector<Extent> extents; // Of every row over all layers, if known
+
+            Snapshot() : width{0}, height{0}, active{0} {}
+            Snapshot(uint width, uint height, std::vector<Pixel> pixels) : width{width}, height{height}, pixels{pixels}, active{0} {}
+
+            void save(std::string file) const {
+                write_atomically(file, [&](std::ostream& output) { Canvas::write(output, *this); });
+            }
+        };
+
+        static void write(std::ostream& output, const Snapshot& s) {
+            uint count = std::max<size_t>(s.layers.size(), 1);
+            output << version_no << '\0';
+            output.write(reinterpret_cast<const char*>(&s.width), sizeof(s.width));
+            output.write(reinterpret_cast<const char*>(&s.height), sizeof(s.height));
+            output.write(reinterpret_cast<const char*>(&count), sizeof(count));
+            output.write(reinterpret_cast<const char*>(&s.active), sizeof(s.active));
+
+            if (s.layers.empty()) {
+                output << "Layer 1" << '\0';
+                output.put(1).put(255).put(BLEND_NORMAL);
+                write_pixels(output, s, s.pixels);
+            }
+            for (const Snapshot::Layer& l : s.layers) {
+                output << l.name << '\0';
+                output.put(l.visible).put(l.opacity).put(l.blend);
+                write_pixels(output, s, l.pixels);
+            }
+        }
+
+        /* Writes the pixels of one layer a row at a time. Columns outside the extents of the rows are all
+         * transparent, so they are copied from a row of transparent pixels which is only encoded once. */
+        static void write_pixels(std::ostream& output, const Snapshot& s, const std::vector<Pixel>& pixels) {
+            std::vector<char> empty(s.width * Pixel::RECORD_SIZE);
+            for (uint j = 0; j < s.width; j++) Pixel::transparent.write_record(&empty[j * Pixel::RECORD_SIZE]);
+            std::vector<char> row(s.width * Pixel::RECORD_SIZE);
+
+            for (uint i = 0; i < s.height; i++) {
+                Extent e = i < s.extents.size() ? s.extents[i] : Extent{0, s.width - 1};
+                if (e.empty()) {
+                    output.write(empty.data(), empty.size());
+                    continue;
+                }
+                std::copy(empty.begin(), empty.begin() + e.first * Pixel::RECORD_SIZE, row.begin());
+                for (uint j = e.first; j <= e.last; j++) pixels[i * s.width + j].write_record(&row[j * Pixel::RECORD_SIZE]);
+                std::copy(empty.begin() + (e.last + 1) * Pixel::RECORD_SIZE, empty.end(), row.begin() + (e.last + 1) * Pixel::RECORD_SIZE);
+                output.write(row.data(), row.size());
+            }
+        }
+
+        /* Blends src over dst. Pixels without a color of their own (e.g. transparent ones) can't be blended, so
+         * they are replaced. */
+        static void blend(Pixel& dst, const Pixel& src, BlendMode mode, uchar opacity) {
+            if (src.code == TRANSPARENT) return;
+            if (src.code != NONE || dst.code != NONE || (mode == BLEND_NORMAL && opacity == 255)) {
+                dst = src;
+                return;
+            }
+
+            auto channel = [&](uchar d, uchar s) {
+                int m = mode == BLEND_MULTIPLY ? s * d / 255 : mode == BLEND_ADD ? std::min(255, s + d) : s;
+                return (uchar)(d + (m - d) * opacity / 255);
+            };
+            dst.r = channel(dst.r, src.r);
+            dst.g = channel(dst.g, src.g);
+            dst.b = channel(dst.b, src.b);
+            if (src.text.compare(0, 2, "  ") != 0) {
+                dst.text = src.text;
+                dst.fg_r = src.fg_r;
+                dst.fg_g = src.fg_g;
+                dst.fg_b = src.fg_b;
+            }
+        }
+
+    private:
+        struct CanvasHolder {
+            Pixel* canvas;
+            uint width;
+            uint height;
+            uint layer;   // The id of the layer
+            bool chained; // Undone together with the holder before it
+
+            CanvasHolder(Pixel* canvas, uint width, uint height, uint layer = 0, bool chained = false) :
+                canvas{canvas}, width{width}, height{height}, layer{layer}, chained{chained} {}
+        };
+
+        struct Layer {
+            uint id; // Stays the same when layers are moved, so the undo history can refer to it
+            std::string name;
+            bool visible;
+            uchar opacity;
+            BlendMode blend;
+            Pixel* pixels;
+        };
+
+        /* Drawing happens on the active layer, whose pixels are also kept in canvas. */
+        std::vector<Layer> layers;
+        uint active;
+        uint next_id;
+        Pixel* canvas;
+
+        /* What is shown is composited from the layers one tile at a time, and only tiles which may have changed
+         * since they were composited are done again. */
+        static const uint TILE = 16;
+        std::vector<Pixel> composite;
+        std::vector<uchar> dirty_tiles;
+        uint tiles_x = 0;
+        uint composite_width = 0;
+
+        bool composite_valid() { return composite.size() == width * height && composite_width == width; }
+
+        Selection selection;
+
+        /* The selection, which is dropped when the canvas changes size. */
+        const Selection& mask() {
+            if (selection.get_width() != width || selection.get_height() != height) selection = Selection(width, height);
+            return selection;
+        }
+
+        /* Write policies for the raster kernels below. The kernels are templates instantiated for every policy
+         * they are used with, so what a write does is decided when compiling rather than for every pixel. */
+        struct OpaqueWrite {
+            static const bool preview = false;
+            void operator()(Pixel& dst, const Pixel& src) const { dst.copy(src); }
+        };
+
+        struct SkipTransparentWrite {
+            static const bool preview = false;
+            void operator()(Pixel& dst, const Pixel& src) const { if (src.code != TRANSPARENT) dst.copy(src); }
+        };
+
+        /* Only draws over transparent pixels, as if behind everything else. */
+        struct BehindWrite {
+            static const bool preview = false;
+            void operator()(Pixel& dst, const Pixel& src) const { if (dst.code == TRANSPARENT) dst.copy(src); }
+        };
+
+        struct BoundaryWrite {
+            static const bool preview = false;
+            void operator()(Pixel& dst, const Pixel&) const { if (dst.code != BOUNDARY) dst.set_code(BOUNDARY); }
+        };
+
+        /* Marks pixels as previewed, which reset_temp undoes. */
+        struct PreviewWrite {
+            static const bool preview = true;
+            void operator()(Pixel& dst, const Pixel&) const { dst.code = TEMP; }
+        };
+
+        struct BlendWrite {
+            static const bool preview = false;
+            BlendMode mode;
+            uchar opacity;
+            void operator()(Pixel& dst, const Pixel& src) const { blend(dst, src, mode, opacity); }
+        };
+
+        LineSet temp_lines; // Lines which may hold previewed pixels
+
+        /* Runs kernel with the policy for drawing c. Previews only mark the pixels they cover, and anything else
+         * overwrites them and clears what was previewed. */
+        template<typename Kernel> void with_write(const Pixel& c, Kernel kernel) {
+            if (c.code == TEMP) {
+                kernel(PreviewWrite());
+                return;
+            }
+            kernel(OpaqueWrite());
+            reset_temp();
+        }
+
+        template<typename Write> void plot(const Write& write, uint y, uint x, const Pixel& c) {
+            write(canvas[y * width + x], c);
+            touch(y, x, x);
+            if constexpr (Write::preview) temp_lines.insert(y);
+        }
+
+        /* Writes the selected pixels of row y between x0 and x1, clipped to the canvas. */
+        template<typename Write> void span(const Write& write, int y, int x0, int x1, const Pixel& c) {
+            x0 = std::max(x0, 0);
+            x1 = std::min(x1, (int)width - 1);
+            if (y < 0 || y >= height || x0 > x1) return;
+            Pixel* row = canvas + y * width;
+            mask().for_each(y, x0, x1, [&](uint x) { write(row[x], c); });
+            touch(y, x0, x1);
+            if constexpr (Write::preview) temp_lines.insert(y);
+        }
+
+        /* Writes columns x0 to x1 of a row of src to row y at column x, clipped to the canvas. */
+        template<typename Write> void blit_row(const Write& write, const Pixel* src, uint x0, uint x1, uint y, uint x) {
+            if (y >= height || x >= width || x0 > x1) return;
+            x1 = std::min(x1, x0 + width - 1 - x);
+            Pixel* row = canvas + y * width + x - x0;
+            for (uint j = x0; j <= x1; j++) write(row[j], src[j]);
+            touch(y, x, x + x1 - x0);
+        }
+
+        template<typename Write> void line(const Write& write, Point<uint> start, Point<uint> end, const Pixel& c, uint fineness) {
+            double delta = 1 / (double)fineness;
+            Point<double> b(start.x, start.y);
+            Point<double> e(end.x, end.y);
+            Point<double> d = Point((e.x - b.x), (e.y - b.y)) * delta;
+
+            for (int i = 0; i <= fineness; i++) {
+                plot(write, std::lround(b.y), std::lround(b.x), c);
+                b += d;
+            }
+        }
+
+        bool flat() { return layers.size() == 1 && layers[0].visible && layers[0].opacity == 255; }
+
+        void dirty_all() { dirty_tiles.assign(dirty_tiles.size(), 1); }
+
+        void add_layer_pixels(std::string name, Pixel* pixels, bool visible = true, uchar opacity = 255, BlendMode blend = BLEND_NORMAL) {
+            layers.push_back(Layer{next_id++, name, visible, opacity, blend, pixels});
+        }
+
+        /* Points canvas at the active layer again after its pixels have been replaced. */
+        void set_active_pixels(Pixel* pixels) {
+            layers[active].pixels = pixels;
+            canvas = pixels;
+        }
+
+        Layer* find_layer(uint id) {
+            for (Layer& l : layers) if (l.id == id) return &l;
+            return NULL;
+        }
+
+        void clear_history() {
+            for (int i = 0; i < past_canvases.size(); i++) delete[] past_canvases[i].canvas;
+            past_canvases.clear();
+            unlogged = 0;
+        }
+
+        void update_composite() {
+            uint tiles_y = (height + TILE - 1) / TILE;
+            if (!composite_valid()) {
+                composite.resize(width * height);
+                composite_width = width;
+                tiles_x = (width + TILE - 1) / TILE;
+                dirty_tiles.assign(tiles_x * tiles_y, 1);
+            }
+
+            for (uint t = 0; t < dirty_tiles.size(); t++) {
+                if (!dirty_tiles[t]) continue;
+                dirty_tiles[t] = 0;
+                uint x0 = t % tiles_x * TILE;
+                uint y0 = t / tiles_x * TILE;
+                uint x1 = std::min(x0 + TILE, width);
+                for (uint i = y0; i < std::min(y0 + TILE, height); i++) {
+                    Pixel* row = &composite[i * width];
+                    for (uint j = x0; j < x1; j++) row[j].copy(Pixel::transparent);
+                    for (const Layer& l : layers) {
+                        if (!l.visible) continue;
+                        BlendWrite write{l.blend, l.opacity};
+                        for (uint j = x0; j < x1; j++) write(row[j], l.pixels[i * width + j]);
+                    }
+                }
+            }
+        }
+
+        /* The pixels which are shown. */
+        const Pixel* shown() {
+            if (flat()) return canvas;
+            update_composite();
+            return composite.data();
+        }
+
+        std::vector<CanvasHolder> past_canvases;
+        uint unlogged; // How many of the oldest undo steps were taken before the log's last checkpoint
+        LineSet update_lines;
+        std::set<Point<Point<uint>>> boundary_points;
+        uint width;
+        uint height;
+
+        void check_point(Point<uint> p) {
+            if (p.x >= width || p.y >= height) throw std::invalid_argument(std::format("Invalid point ({},{}) in dimensions {}x{}", p.x, p.y, width, height).c_str());
+        }
+
+        bool intersects(Point<uint> p1, Point<uint> p2, Point<uint> p3, Point<uint> p4) {
+            int x1 = p1.x;
+            int x2 = p2.x;
+            int x3 = p3.x;
+            int x4 = p4.x;
+            int y1 = p1.y;
+            int y2 = p2.y;
+            int y3 = p3.y;
+            int y4 = p4.y;
+            int a = x1 - x2;
+            int b = x4 - x3;
+            int c = y1 - y2;
+            int d = y4 - y3;
+            int e = x4 - x2;
+            int f = y4 - y2;
+            int det = a * d - b * c;
+
+            if (det != 0) { // Matrix is invertible; single solution
+                int t = d * e - b * f;
+                int s = a * f - c * e;
+
+                if (det > 0) {
+                    return 0 <= t && t <= det && 0 <= s && s <= det;
+                } else {
+                    return det <= t && t <= 0 && det <= s && s <= 0;
+                }
+            } else { //  Matrix is singular
+                if (a != 0) {
+                    double alpha = (double)b / a;
+                    if (a * f != e * c) return false; // No solutions
+                    if (alpha > 0) {
+                        return std::max(0., (double)e / a - alpha) <= std::min(1., (double)e / a);
+                    } else {
+                        return std::max(0., (double)e / a) <= std::min(1., (double)e / a - alpha);
+                    }
+                } else {
+                    if (d != 0) {
+                        double alpha = (double)c / d;
+                        if (b != 0) {
+                            double s = (double)e / b;
+                            double t = ((double)f / d - s) / alpha;
+                            return 0 <= s && s <= 1 && 0 <= t && t <= 1;
+                        } else {
+                            if (e != 0) return false;
+                            if (alpha > 0) {
+                                return std::max(0., (double)f / d - alpha) <= std::min(1., (double)f / d);
+                            } else {
+                                return std::max(0., (double)f / d) <= std::min(1., (double)f / d - alpha);
+                            }
+                        }
+                    } else {
+                        if (e != 0 || f != 0) return false;
+                        return true;
+                    }
+                }
+            }
+        }
+
+        bool in_area(Point<uint> p, Point<uint> center) {
+            uint count = 0;
+
+            for (const Point<Point<uint>>& b : boundary_points) {
+                if (intersects(b.x, b.y, p, center)) count++;
+            }
+
+            return count % 2 == 0;
+        }
+
+        /* Encoded rows are cached by a hash of everything they depend on, so repeated rows share one buffer.
+         * Every row also has a version which changes with its pixels, so rows which are only drawn again
+         * (e.g. after clearing the screen) reuse the buffer they were last drawn with without hashing. */
+        struct EncodedRow {
+            uint64_t version;
+            bool editor;
+            const void* onion;
+            std::shared_ptr<const std::string> bytes;
+        };
+
+        std::vector<uint64_t> versions;
+        uint64_t version_counter = 0;
+        std::vector<EncodedRow> encoded_rows; // By screen row
+        std::unordered_map<uint64_t, std::shared_ptr<const std::string>> row_cache;
+        static const uint ROW_CACHE_SIZE = 4096;
+
+        /* The extent of every row over all layers is kept with the version of the row it was found for, so only rows
+         * which have been touched since are scanned again. */
+        std::vector<Extent> extents;
+        std::vector<uint64_t> extent_versions;
+        uint extents_width = 0;
+        uint64_t bounds_version = -1; // The version_counter when the bounds were found
+        Point<uint> bounds_min = Point<uint>(0, 0);
+        Point<uint> bounds_max = Point<uint>(0, 0);
+        bool bounds_empty = true;
+
+        /* Marks a line whose pixels have changed to be drawn. */
+        void touch(uint i) {
+            if (versions.size() != height) versions.resize(height);
+            versions[i] = ++version_counter;
+            update_lines.insert(i);
+            if (composite_valid())
+                std::fill_n(dirty_tiles.begin() + i / TILE * tiles_x, tiles_x, 1);
+        }
+
+        /* Like touch, when only columns x0 to x1 of the line have changed. */
+        void touch(uint i, uint x0, uint x1) {
+            if (!composite_valid()) {
+                touch(i);
+                return;
+            }
+            if (versions.size() != height) versions.resize(height);
+            versions[i] = ++version_counter;
+            update_lines.insert(i);
+            for (uint t = x0 / TILE; t <= std::min(x1, width - 1) / TILE; t++) dirty_tiles[i / TILE * tiles_x + t] = 1;
+        }
+
+        bool empty_rows(uint y, uint rows) {
+            for (uint i = y; i < y + rows; i++) if (!extent(i).empty()) return false;
+            return true;
+        }
+
+        const std::string& encode_row(const Pixel* canvas, uint r, bool editor, const Snapshot* onion) {
+            uint y = half_blocks ? 2 * r : r;
+            uint rows = half_blocks && y + 1 < height ? 2 : 1;
+            uint64_t version = 0;
+            if (versions.size() != height) versions.resize(height);
+            for (uint i = y; i < y + rows; i++) version = std::max(version, versions[i]);
+
+            if (encoded_rows.size() != screen_rows(height)) encoded_rows.assign(screen_rows(height), EncodedRow{0, false, NULL, NULL});
+            EncodedRow& slot = encoded_rows[r];
+            if (slot.bytes && slot.version == version && slot.editor == editor && slot.onion == onion) return *slot.bytes;
+
+            uint64_t key = (uint64_t)width << 32 | rows << 4 | half_blocks << 3 | editor << 2;
+            if (Palette::dither) key = key * 31 + (y & 3) + 1;
+            if (onion == NULL && empty_rows(y, rows)) { // Empty rows look the same whatever their pixels hold
+                key = (key ^ 0x5bd1e995) * 0x9e3779b97f4a7c15;
+            } else {
+                for (uint i = y * width; i < (y + rows) * width; i++) key = canvas[i].hash(key);
+                if (onion != NULL) for (uint i = y * width; i < (y + rows) * width; i++) key = onion->pixels[i].hash(key);
+            }
+
+            auto it = row_cache.find(key);
+            if (it == row_cache.end()) {
+                std::string line;
+                CellEncoder e(line);
+                for (uint j = 0; j < width; j++) {
+                    uint i = y * width + j;
+                    if (!half_blocks) canvas[i].encode(e, editor, j, y, onion != NULL ? &onion->pixels[i] : NULL);
+                    else Pixel::encode_half(e, canvas[i], rows > 1 ? &canvas[i + width] : NULL, editor, j, y,
+                            onion != NULL ? &onion->pixels[i] : NULL, onion != NULL && rows > 1 ? &onion->pixels[i + width] : NULL);
+                }
+
+                if (row_cache.size() >= ROW_CACHE_SIZE) row_cache.clear();
+                it = row_cache.emplace(key, std::make_shared<const std::string>(std::move(line))).first;
+            }
+
+            slot = EncodedRow{version, editor, onion, it->second};
+            return *slot.bytes;
+        }
+
+        void draw_rows(bool editor, const Snapshot* onion, const Pixel* previous = NULL);
+
+        friend class AnsiRenderer;
+
+        /* Restores the previewed pixels. Only lines which previews were drawn on are looked at. */
+        void reset_temp() {
+            for (uint i : temp_lines) {
+                if (i >= height) break;
+                bool changed = false;
+                for (uint j = 0; j < width; j++) {
+                    Pixel& c = canvas[i * width + j];
+                    if (c.code != TEMP) continue;
+                    c.code = c.prev_code;
+                    changed = true;
+                }
+                if (changed) touch(i);
+            }
+            temp_lines.clear();
+        }
+
+    public:
+        Canvas(uint width, uint height, Pixel bg = Pixel::transparent) : width{width}, height{height}, active{0}, next_id{0}, unlogged{0} {
+            canvas = new Pixel[width * height];
+            for (int i = 0; i < width * height; i++) canvas[i] = bg;
+            add_layer_pixels("Layer 1", canvas);
+            for (int i = 0; i < height; i++) touch(i);
+        }
+
+        Canvas(std::string filename) : active{0}, next_id{0}, unlogged{0} {
+            std::ifstream input_file;
+            input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            input_file.open(filename, std::ios::binary | std::ios::in);
+            load(input_file);
+        }
+
+        Canvas(std::istream& input_file) : active{0}, next_id{0}, unlogged{0} {
+            load(input_file);
+        }
+
+        void load(std::istream& input_file) {
+            std::string vno;
+            char c;
+
+            while (true) {
+                input_file >> c;
+                if (c != 0) {
+                    vno += c;
+                } else break;
             }
 
-            if (holder.canvas == NULL) return;
+            if (vno != version_no && vno != legacy_version_no && vno != anim_version_no)
+                throw std::invalid_argument(std::format("Invalid version: current {} vs {}", version_no, vno).c_str());
 
-            delete[] canvas;
-            width = holder.width;
-            height = holder.height;
-            canvas = holder.canvas;
+            input_file.read(reinterpret_cast<char*>(&width), sizeof(width));
+            input_file.read(reinterpret_cast<char*>(&height), sizeof(height));
+
+            if (vno == anim_version_no) { // Animations begin with a full keyframe, which is loaded as the canvas
+                uint frames, delay, changed;
+                input_file.read(reinterpret_cast<char*>(&frames), sizeof(frames));
+                input_file.read(reinterpret_cast<char*>(&delay), sizeof(delay));
+                input_file.read(reinterpret_cast<char*>(&changed), sizeof(changed));
+            }
+
+            uint count = 1;
+            if (vno == version_no) {
+                input_file.read(reinterpret_cast<char*>(&count), sizeof(count));
+                input_file.read(reinterpret_cast<char*>(&active), sizeof(active));
+                if (count == 0 || active >= count) throw std::invalid_argument(std::format("Invalid layer {} of {}", active, count).c_str());
+            }
+
+            for (uint k = 0; k < count; k++) {
+                std::string name = "Layer 1";
+                bool visible = true;
+                uchar opacity = 255;
+                uchar blend = BLEND_NORMAL;
+                if (vno == version_no) {
+                    std::getline(input_file, name, '\0');
+                    visible = input_file.get();
+                    opacity = input_file.get();
+                    blend = input_file.get();
+                    if (blend > BLEND_ADD) throw std::invalid_argument(std::format("Invalid blend mode {}", blend).c_str());
+                }
+
+                Pixel* pixels = new Pixel[width * height];
+                Pixel::read_all(input_file, pixels, width * height);
+                add_layer_pixels(name, pixels, visible, opacity, (BlendMode)blend);
+            }
+            canvas = layers[active].pixels;
+
+            for (int i = 0; i < height; i++) touch(i);
+        }
+
+        ~Canvas() {
+            for (Layer& l : layers) delete[] l.pixels;
+            for (int i = 0; i < past_canvases.size(); i++) delete[] past_canvases[i].canvas;
+        }
+
+        uint get_width() { return width; }
+        uint get_height() { return height; }
+
+        /* The extent of row i over all layers. */
+        const Extent& extent(uint i) {
+            if (versions.size() != height) versions.resize(height);
+            if (extents.size() != height || extents_width != width) {
+                extents.assign(height, Extent{1, 0});
+                extent_versions.assign(height, -1);
+                extents_width = width;
+            }
+            Extent& e = extents[i];
+            if (extent_versions[i] == versions[i]) return e;
+
+            e = Extent{width, 0};
+            for (const Layer& l : layers) {
+                const Pixel* row = &l.pixels[i * width];
+                for (uint j = 0; j < e.first; j++) {
+                    if (row[j].code == TRANSPARENT) continue;
+                    e.first = j;
+                    break;
+                }
+                for (uint j = width; j-- > std::max(e.first, e.last + 1);) {
+                    if (row[j].code == TRANSPARENT) continue;
+                    e.last = j;
+                    break;
+                }
+            }
+            if (e.first == width) e = Extent{1, 0};
+            else e.last = std::max(e.first, e.last);
+            extent_versions[i] = versions[i];
+            return e;
+        }
+
+        /* Finds the smallest rectangle holding all content, returning false if there is none. */
+        bool content_bounds(Point<uint>& min, Point<uint>& max) {
+            if (bounds_version != version_counter || extents_width != width || extents.size() != height) {
+                bounds_empty = true;
+                for (uint i = 0; i < height; i++) {
+                    const Extent& e = extent(i);
+                    if (e.empty()) continue;
+                    if (bounds_empty) {
+                        bounds_min = Point<uint>(e.first, i);
+                        bounds_max = Point<uint>(e.last, i);
+                        bounds_empty = false;
+                    }
+                    bounds_min.x = std::min(bounds_min.x, e.first);
+                    bounds_max.x = std::max(bounds_max.x, e.last);
+                    bounds_max.y = i;
+                }
+                bounds_version = version_counter;
+            }
+            min = bounds_min;
+            max = bounds_max;
+            return !bounds_empty;
+        }
+
+        void save(std::string file) {
+            snapshot().save(file);
+        }
+
+        Snapshot snapshot() {
+            const Pixel* pixels = shown();
+            Snapshot s(width, height, std::vector<Pixel>(pixels, pixels + width * height));
+            for (const Layer& l : layers)
+                s.layers.push_back(Snapshot::Layer{l.name, l.visible, l.opacity, l.blend, std::vector<Pixel>(l.pixels, l.pixels + width * height)});
+            s.active = active;
+            for (uint i = 0; i < height; i++) s.extents.push_back(extent(i));
+            return s;
+        }
+
+        /* Replaces the canvas with a snapshot. The undo history belongs to the replaced contents, so it is dropped. */
+        void restore(const Snapshot& s) {
+            clear_history();
+            boundary_points.clear();
+
+            for (Layer& l : layers) delete[] l.pixels;
+            layers.clear();
+            width = s.width;
+            height = s.height;
+
+            if (s.layers.empty()) add_layer_pixels("Layer 1", new Pixel[width * height]);
+            for (const Snapshot::Layer& l : s.layers) add_layer_pixels(l.name, new Pixel[width * height], l.visible, l.opacity, l.blend);
+            for (uint k = 0; k < layers.size(); k++) {
+                const std::vector<Pixel>& pixels = s.layers.empty() ? s.pixels : s.layers[k].pixels;
+                std::copy(pixels.begin(), pixels.end(), layers[k].pixels);
+            }
+            active = s.layers.empty() ? 0 : s.active;
+            canvas = layers[active].pixels;
 
             update_lines.clear();
+            dirty_all();
+            for (int i = 0; i < height; i++) touch(i);
+        }
+
+        /* Marks every line to be drawn again, e.g. after the screen has been cleared. */
+        void update_all() {
             for (int i = 0; i < height; i++) update_lines.insert(i);
         }
 
-        void resize(uint width, uint height) {
-            save_old();
-            Pixel* new_canvas = new Pixel[width * height]();
+        void save_old() {
+            save_old(layers[active]);
+        }
 
-            update_lines.clear();
+        void save_old(const Layer& l, bool chained = false) {
+            Pixel* old_canvas = new Pixel[width * height];
+            for (int i = 0; i < width * height; i++) old_canvas[i] = l.pixels[i];
+            past_canvases.push_back(CanvasHolder(old_canvas, width, height, l.id, chained));
+        }
 
-            for (int i = 0; i < std::min(height, this->height); i++) {
-                for (int j = 0; j < std::min(width, this->width); j++)
-                    new_canvas[i * width + j] = canvas[i * this->width + j];
+        /* Called when the log takes a checkpoint. Replaying the log starts without the undo history up to here. */
+        void history_logged() { unlogged = past_canvases.size(); }
+
+        /* Returns false if the undo went back past the log's last checkpoint, so replaying it wouldn't do the same. */
+        bool undo(int times = 1) {
+            for (int i = 0; i < height; i++) touch(i);
+
+            for (int i = 0; i < times && !past_canvases.empty(); i++) {
+                CanvasHolder holder(NULL, 0, 0, 0, true);
+                while (holder.chained && !past_canvases.empty()) {
+                    holder = past_canvases.back();
+                    past_canvases.pop_back();
+
+                    Layer* l = find_layer(holder.layer);
+                    if (l == NULL) {
+                        delete[] holder.canvas;
+                        continue;
+                    }
+                    delete[] l->pixels;
+                    l->pixels = holder.canvas;
+                    width = holder.width;
+                    height = holder.height;
+                }
             }
+            canvas = layers[active].pixels;
 
-            for (int i = 0; i < height; i++) update_lines.insert(i);
+            update_lines.clear();
+            for (int i = 0; i < height; i++) touch(i);
+            return past_canvases.size() >= unlogged;
+        }
 
-            delete[] canvas;
-            canvas = new_canvas;
+        /* Resizes every layer, keeping the top left corner at origin. */
+        void resize(uint width, uint height, Point<uint> origin = Point<uint>(0, 0)) {
+            update_lines.clear();
+
+            for (uint k = 0; k < layers.size(); k++) {
+                save_old(layers[k], k > 0);
+                Pixel* new_canvas = new Pixel[width * height]();
+                for (int i = 0; i < std::min(height, this->height - origin.y); i++) {
+                    for (int j = 0; j < std::min(width, this->width - origin.x); j++)
+                        new_canvas[i * width + j] = layers[k].pixels[(i + origin.y) * this->width + j + origin.x];
+                }
+                delete[] layers[k].pixels;
+                layers[k].pixels = new_canvas;
+            }
+            canvas = layers[active].pixels;
 
             this->width = width;
             this->height = height;
+
+            for (int i = 0; i < height; i++) touch(i);
+        }
+
+        /* Crops every layer to its content, but no smaller than min_size x min_size. Returns false if there is
+         * no content. */
+        bool trim(uint min_size) {
+            Point<uint> min(0, 0), max(0, 0);
+            if (!content_bounds(min, max)) return false;
+            auto grow = [&](uint& lo, uint& hi, uint size) {
+                if (hi - lo + 1 >= min_size) return;
+                hi = std::min(size, lo + min_size) - 1;
+                lo = hi + 1 >= min_size ? hi + 1 - min_size : 0;
+            };
+            grow(min.x, max.x, width);
+            grow(min.y, max.y, height);
+            if (min.x == 0 && min.y == 0 && max.x == width - 1 && max.y == height - 1) return true;
+            resize(max.x - min.x + 1, max.y - min.y + 1, min);
+            return true;
+        }
+
+        /* The pixel which is shown at (i, j). */
+        const Pixel& operator[](uint i, uint j) { return shown()[j * width + i]; }
+
+        uint layer_count() { return layers.size(); }
+        uint get_layer() { return active; }
+
+        std::string describe_layer(uint k) {
+            static const char* blends[] = {"normal", "multiply", "add"};
+            const Layer& l = layers[k];
+            return std::format("{}{}: {} ({}%, {}{})", k == active ? "*" : " ", k, l.name, l.opacity * 100 / 255, blends[l.blend], l.visible ? "" : ", hidden");
+        }
+
+        /* Adds an empty layer above the active one and makes it active. Layers can't be restored by undo, so the
+         * undo history is dropped when they are added, deleted or moved. */
+        void add_layer(std::string name) {
+            clear_history();
+            Pixel* pixels = new Pixel[width * height];
+            for (uint i = 0; i < width * height; i++) pixels[i] = Pixel::transparent;
+            add_layer_pixels(name, pixels);
+            std::rotate(layers.begin() + active + 1, layers.end() - 1, layers.end());
+            active++;
+            canvas = layers[active].pixels;
+            update_layers();
+        }
+
+        void delete_layer() {
+            if (layers.size() == 1) return;
+            clear_history();
+            delete[] layers[active].pixels;
+            layers.erase(layers.begin() + active);
+            if (active == layers.size()) active--;
+            canvas = layers[active].pixels;
+            update_layers();
+        }
+
+        void select_layer(uint k) {
+            if (k >= layers.size()) throw std::invalid_argument(std::format("No layer {}", k).c_str());
+            active = k;
+            canvas = layers[active].pixels;
+        }
+
+        /* Moves the active layer up or down the stack by dk. */
+        void move_layer(int dk) {
+            int k = std::clamp((int)active + dk, 0, (int)layers.size() - 1);
+            if (k == (int)active) return;
+            clear_history();
+            Layer l = layers[active];
+            layers.erase(layers.begin() + active);
+            layers.insert(layers.begin() + k, l);
+            active = k;
+            update_layers();
+        }
+
+        void set_layer_visible(bool visible) {
+            layers[active].visible = visible;
+            update_layers();
+        }
+
+        void set_layer_opacity(uchar opacity) {
+            layers[active].opacity = opacity;
+            update_layers();
         }
 
-        const Pixel& operator[](uint i, uint j) { return canvas[j * width + i]; }
+        void set_layer_blend(BlendMode blend) {
+            layers[active].blend = blend;
+            update_layers();
+        }
+
+        void rename_layer(std::string name) { layers[active].name = name; }
+
+        /* Recomposites everything after the stack of layers has changed. */
+        void update_layers() {
+            dirty_all();
+            for (int i = 0; i < height; i++) touch(i);
+        }
+
+        void select(const Selection& s, SelectOp op) {
+            mask();
+            selection.combine(s, op);
+        }
+
+        void select_wand(Point<uint> p, uint tolerance, SelectOp op) {
+            check_point(p);
+            select(Selection::wand(width, height, canvas, p, tolerance), op);
+        }
+
+        void clear_selection() { selection = Selection(width, height); }
+
+        /* Adjusts the colors of the selected pixels. Transparent pixels and boundaries are left as they are. */
+        void adjust(const ColorAdjustment& a) {
+            save_old();
+
+            std::vector<uint> cells;
+            const Selection& s = mask();
+            for (uint i = 0; i < height; i++) {
+                s.for_each(i, 0, width - 1, [&](uint j) {
+                    if (canvas[i * width + j].code == NONE) cells.push_back(i * width + j);
+                });
+            }
+
+            uint n = (cells.size() + 3) / 4 * 4;
+            std::vector<int> r(n), g(n), b(n);
+            for (uint k = 0; k < cells.size(); k++) {
+                const Pixel& c = canvas[cells[k]];
+                r[k] = c.r;
+                g[k] = c.g;
+                b[k] = c.b;
+            }
+
+            a.apply(r.data(), g.data(), b.data(), n);
+
+            for (uint k = 0; k < cells.size(); k++) {
+                Pixel& c = canvas[cells[k]];
+                c.r = r[k];
+                c.g = g[k];
+                c.b = b[k];
+                if (k == 0 || cells[k] / width != cells[k - 1] / width) touch(cells[k] / width);
+            }
+        }
+
+        const Selection& get_selection() { return mask(); }
 
         void update_line(uint i) { update_lines.insert(i); }
 
@@ -390,7 +3006,7 @@ class Canvas {
             check_point(p);
             save_old();
             canvas[p.y * width + p.x] = c;
-            update_lines.insert(p.y);
+            touch(p.y, p.x, p.x);
         }
 
         void draw_rectange(Point<uint> start, Point<uint> end, Pixel c) {
@@ -413,21 +3029,25 @@ class Canvas {
             Point<uint> b = Point<uint>(std::min(start.x, end.x), std::min(start.y, end.y));
             Point<uint> e = Point<uint>(std::max(start.x, end.x), std::max(start.y, end.y));
 
-            for (int i = b.y; i <= e.y; i++) {
-                for (int j = b.x; j <= e.x; j++)
-                    canvas[i * width + j] = c;
-                update_lines.insert(i);
-            }
+            with_write(c, [&](auto write) {
+                for (int i = b.y; i <= e.y; i++) span(write, i, b.x, e.x, c);
+            });
         }
 
         void add_text(Point<uint> p, std::string text, uchar r, uchar g, uchar b) {
-            for (int i = p.x, j = 0; i < width && j < text.length(); i++, j += 2) {
+            check_point(p);
+            if (text.empty()) return;
+            save_old();
+
+            uint i = p.x;
+            for (uint j = 0; i < width && j < text.length(); i++, j += 2) {
                 Pixel& c = canvas[p.y * width + i];
                 c.text = std::format("{}{}", text[j], (j + 1 < text.length()) ? text[j+1] : ' ');
                 c.fg_r = r;
                 c.fg_g = g;
                 c.fg_b = b;
             }
+            touch(p.y, p.x, i - 1);
         }
 
         void move(Point<uint> start, Point<uint> end, Point<uint> dest) {
@@ -443,138 +3063,455 @@ class Canvas {
             Pixel* new_canvas = new Pixel[width * height];
             for (int i = 0; i < width * height; i++) new_canvas[i] = canvas[i];
 
+            const Selection& s = mask();
             for (int i = b.y; i <= e.y; i++) {
-                update_lines.insert(i);
-                for (int j = b.x; j <= e.x; j++)
-                    new_canvas[i * width + j] = Pixel();
+                touch(i);
+                s.for_each(i, b.x, e.x, [&](uint j) { new_canvas[i * width + j] = Pixel(); });
             }
 
             int dy = e.y - b.y + 1;
             int dx = e.x - b.x + 1;
             for (int i = 0; i < std::min(dy, (int)height - (int)dest.y); i++) {
-                update_lines.insert(dest.y + i);
-                for (int j = 0; j < std::min(dx, (int)width - (int)dest.x); j++) {
-                    new_canvas[(dest.y + i) * width + dest.x + j] = canvas[(b.y + i) * width + b.x + j];
-                }
+                touch(dest.y + i);
+                s.for_each(b.y + i, b.x, b.x + std::min(dx, (int)width - (int)dest.x) - 1, [&](uint j) {
+                    new_canvas[(dest.y + i) * width + dest.x + j - b.x] = canvas[(b.y + i) * width + j];
+                });
             }
 
             delete[] canvas;
-            canvas = new_canvas;
+            set_active_pixels(new_canvas);
         }
 
         void insert_art(std::string filename, Point<uint> dest) {
-            Canvas art(filename);
+            Task::run(insert_art_task(filename, dest));
+        }
+
+        /* Loads the art right away, and pastes it a row at a time. */
+        Task* insert_art_task(std::string filename, Point<uint> dest) {
+            std::shared_ptr<Canvas> art = std::make_shared<Canvas>(filename);
+            uint art_width = art->get_width();
+
+            save_old();
+
+            Point<uint> min(0, 0), max(0, 0);
+            if (!art->content_bounds(min, max)) return new Task(0, NULL, NULL, NULL);
+            const Pixel* pixels = art->shown();
 
-            uint art_width = art.get_width();
-            uint art_height = art.get_height();
+            return new Task(max.y - min.y + 1, [=, this](uint n) {
+                uint i = min.y + n;
+                const Extent& e = art->extent(i);
+                if (!e.empty()) blit_row(SkipTransparentWrite(), pixels + i * art_width, e.first, e.last, dest.y + i, dest.x + e.first);
+            }, NULL, [this]() { undo(); });
+        }
+
+        /* The size of canvas which holds the art, which depends on how many terminal cells make a pixel. */
+        static Point<uint> ansi_size(const AnsiParser& art) {
+            uint cols = art.columns();
+            uint rows = art.rows.size();
+            if (half_blocks) return Point<uint>(std::max(cols, 1u), std::max(2 * rows, 1u));
+            return Point<uint>(std::max((cols + 1) / 2, 1u), std::max(rows, 1u));
+        }
+
+        /* Draws parsed ANSI art at dest. Block and shade characters become the colors they show, a pixel of two cells
+         * holding ASCII text keeps it as the pixel's text, and cells left in the terminal's own background are
+         * transparent, so like in insert_art they leave the canvas as it was. */
+        void import_ansi(const AnsiParser& art, Point<uint> dest) {
+            check_point(dest);
+            static const int light = 0xE5E5E5; // What the terminal's own foreground usually is
+
+            auto mix = [](int fg, int bg, float t) {
+                if (fg == AnsiParser::DEFAULT) fg = light;
+                if (bg == AnsiParser::DEFAULT) return t >= 0.5 ? fg : AnsiParser::DEFAULT;
+                int out = 0;
+                for (int s = 0; s <= 16; s += 8)
+                    out |= (int)std::lround(((fg >> s) & 255) * t + ((bg >> s) & 255) * (1 - t)) << s;
+                return out;
+            };
+            auto average = [](int a, int b) {
+                if (a == AnsiParser::DEFAULT) return b;
+                if (b == AnsiParser::DEFAULT) return a;
+                return (((a >> 16 & 255) + (b >> 16 & 255) + 1) / 2) << 16 | (((a >> 8 & 255) + (b >> 8 & 255) + 1) / 2) << 8
+                    | ((a & 255) + (b & 255) + 1) / 2;
+            };
+            // The colors shown in the top and bottom halves of a cell
+            auto halves = [&](const AnsiParser::Cell& c, int& top, int& bottom) {
+                top = bottom = c.bg;
+                switch (c.glyph) {
+                    case U'█': top = bottom = mix(c.fg, c.bg, 1); break;
+                    case U'▀': top = mix(c.fg, c.bg, 1); break;
+                    case U'▄': bottom = mix(c.fg, c.bg, 1); break;
+                    case U'░': top = bottom = mix(c.fg, c.bg, 0.25); break;
+                    case U'▒': case U'▌': case U'▐': top = bottom = mix(c.fg, c.bg, 0.5); break;
+                    case U'▓': top = bottom = mix(c.fg, c.bg, 0.75); break;
+                }
+            };
+            auto put = [&](uint y, uint x, int color) {
+                if (color != AnsiParser::DEFAULT) canvas[y * width + x] = Pixel(color >> 16, color >> 8 & 255, color & 255);
+            };
+            static const AnsiParser::Cell blank{' ', AnsiParser::DEFAULT, AnsiParser::DEFAULT};
+            auto cell = [&](uint i, uint j) -> const AnsiParser::Cell& {
+                return j < art.rows[i].size() ? art.rows[i][j] : blank;
+            };
 
             save_old();
 
-            for (int i = dest.y; i < dest.y + art_height && i < height; i++) {
-                update_lines.insert(i);
-                for (int j = dest.x; j < dest.x + art_width && j < width; j++) {
-                    Pixel& c = art.canvas[(i - dest.y) * art_width + j - dest.x];
-                    if (c.code == TRANSPARENT) continue;
-                    canvas[i * width + j] = c;
+            for (uint i = 0; i < art.rows.size(); i++) {
+                uint y = dest.y + (half_blocks ? 2 * i : i);
+                if (y >= height) break;
+                touch(y);
+                if (half_blocks && y + 1 < height) touch(y + 1);
+                uint cols = half_blocks ? art.rows[i].size() : (art.rows[i].size() + 1) / 2;
+
+                for (uint j = 0; j < cols && dest.x + j < width; j++) {
+                    uint x = dest.x + j;
+                    int top, bottom;
+
+                    if (half_blocks) {
+                        halves(cell(i, j), top, bottom);
+                        put(y, x, top);
+                        if (y + 1 < height) put(y + 1, x, bottom);
+                        continue;
+                    }
+
+                    const AnsiParser::Cell& a = cell(i, 2 * j);
+                    const AnsiParser::Cell& b = cell(i, 2 * j + 1);
+                    auto is_text = [](const AnsiParser::Cell& c) { return c.glyph > ' ' && c.glyph < 0x7F; };
+
+                    if (is_text(a) || is_text(b)) {
+                        std::string text = {is_text(a) ? (char)a.glyph : ' ', is_text(b) ? (char)b.glyph : ' '};
+                        int fg = is_text(a) ? a.fg : b.fg;
+                        int bg = average(a.bg, b.bg);
+                        if (fg == AnsiParser::DEFAULT) fg = light;
+                        if (bg == AnsiParser::DEFAULT) bg = 0;
+                        canvas[y * width + x] = Pixel(bg >> 16, bg >> 8 & 255, bg & 255, fg >> 16, fg >> 8 & 255, fg & 255, text);
+                        continue;
+                    }
+
+                    int a_top, a_bottom, b_top, b_bottom;
+                    halves(a, a_top, a_bottom);
+                    halves(b, b_top, b_bottom);
+                    put(y, x, average(average(a_top, a_bottom), average(b_top, b_bottom)));
                 }
             }
         }
 
-        void blur(uint x_reduction, uint y_reduction) {
+        /* Imports an image resampled to w x h at dest with an area filter. The image is decoded and resampled one
+         * row at a time, so only the destination rows that are still being accumulated are kept. Pixels which are
+         * mostly transparent in the image are skipped, like in insert_art. */
+        void import_image(ImageReader& image, Point<uint> dest, uint w, uint h) {
+            check_point(dest);
+
+            uint src_w = image.get_width();
+            uint src_h = image.get_height();
+            ResampleTable cols = ResampleTable::area(src_w, w);
+            ResampleTable rows = ResampleTable::area(src_h, h);
+
+            std::vector<uint> last_src(h);      // The last source row contributing to each destination row
+            for (uint i = 0; i < h; i++) last_src[i] = rows.index[rows.start[i + 1] - 1];
+
+            uint slots = (h + src_h - 1) / src_h + 2;
+            std::vector<uchar> rgba(4 * src_w);
+            std::vector<float> row(4 * w);
+            std::vector<float> acc(4 * w * slots, 0);
+            uint first_open = 0;                // The first destination row which isn't complete
+
             save_old();
 
-            uint width = this->width / x_reduction;
-            uint height = this->height / y_reduction;
-            Pixel* new_canvas = new Pixel[width * height];
-            uint r,g,b;
-            uint count;
-            bool is_trans;
+            for (uint y = 0; y < src_h; y++) {
+                image.read_row(rgba.data());
+
+                for (uint j = 0; j < w; j++) {
+                    float r = 0, g = 0, b = 0, a = 0;
+                    for (uint t = cols.start[j]; t < cols.start[j + 1]; t++) {
+                        const uchar* p = &rgba[4 * cols.index[t]];
+                        float wa = cols.weight[t] * p[3];
+                        r += wa * p[0];
+                        g += wa * p[1];
+                        b += wa * p[2];
+                        a += wa;
+                    }
+                    row[4 * j] = r;
+                    row[4 * j + 1] = g;
+                    row[4 * j + 2] = b;
+                    row[4 * j + 3] = a;
+                }
 
-            update_lines.clear();
+                for (uint i = first_open; i < h && rows.index[rows.start[i]] <= y; i++) {
+                    float* slot = &acc[4 * w * (i % slots)];
+                    for (uint t = rows.start[i]; t < rows.start[i + 1]; t++) {
+                        if (rows.index[t] != y) continue;
+                        float wv = rows.weight[t];
+                        for (uint j = 0; j < 4 * w; j++) slot[j] += wv * row[j];
+                    }
+                }
 
-            for (int i = 0; i < height; i++) {
-                update_lines.insert(i);
-                for (int j = 0; j < width; j++) {
-                    r = 0;
-                    g = 0;
-                    b = 0;
-                    count = 0;
-                    is_trans = true;
-
-                    for (int k = i * y_reduction; k < i * y_reduction + y_reduction && k < this->height; k++) {
-                        for (int l = j * x_reduction; l < j * x_reduction + x_reduction && l < this->width; l++) {
-                            Pixel& c = canvas[k * this->width + l];
-                            if (c.code != TRANSPARENT) {
-                                is_trans = false;
-                                r += c.r;
-                                g += c.g;
-                                b += c.b;
-                                count++;
-                            }
+                for (; first_open < h && last_src[first_open] == y; first_open++) {
+                    float* slot = &acc[4 * w * (first_open % slots)];
+                    uint i = dest.y + first_open;
+
+                    if (i < height) {
+                        touch(i);
+                        for (uint j = 0; j < w && dest.x + j < width; j++) {
+                            float a = slot[4 * j + 3];
+                            if (a < 127.5f) continue;
+                            auto channel = [a](float v) { return (uchar)std::min(v / a + .5f, 255.f); };
+                            canvas[i * width + dest.x + j] = Pixel(channel(slot[4 * j]), channel(slot[4 * j + 1]), channel(slot[4 * j + 2]));
                         }
                     }
 
-                    if (is_trans) new_canvas[i * width + j] = Pixel::transparent;
-                    else new_canvas[i * width + j] = Pixel(r / count, g / count, b / count);
+                    std::fill(slot, slot + 4 * w, 0);
                 }
             }
+        }
 
-            delete[] canvas;
+        /* Writes the canvas into image one row at a time, with every pixel zoomed into a zoom x zoom square. */
+        void export_image(ImageWriter& image, uint zoom = 1) {
+            std::vector<uchar> rgba(4 * width * zoom);
+            const Pixel* pixels = shown();
+
+            for (uint i = 0; i < height; i++) {
+                for (uint j = 0; j < width; j++) {
+                    const Pixel& c = pixels[i * width + j];
+                    uchar px[4] = {c.r, c.g, c.b, (uchar)(c.code == TRANSPARENT ? 0 : 255)};
+                    for (uint k = 0; k < zoom; k++) std::copy(px, px + 4, &rgba[4 * (j * zoom + k)]);
+                }
+                for (uint k = 0; k < zoom; k++) image.write_row(rgba.data());
+            }
+
+            image.finish();
+        }
+
+        /* Writes the escape sequences which display the canvas, with lines separated by newlines, so the file can
+         * be shown with cat. */
+        void export_ans(std::string file) {
+            std::ofstream output_file;
+            output_file.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+            output_file.open(file, std::ios::binary | std::ios::out | std::ios::trunc);
+            const Pixel* pixels = shown();
+
+            for (uint i = 0; i < height; i++) {
+                std::string line;
+                CellEncoder e(line);
+                for (uint j = 0; j < width; j++) pixels[i * width + j].encode(e, false, j, i);
+                e.reset();
+                output_file << line << "\n";
+            }
+
+            output_file.close();
+        }
+
+        /* Exports to a PNG, PPM or ANSI file depending on the extension of file. */
+        void export_file(std::string file, uint zoom = 1, bool stored = false) {
+            std::string ext = file.substr(std::min(file.length(), file.rfind('.')));
+            if (zoom == 0) zoom = 1;
+
+            if (ext == ".png") {
+                PngWriter image(file, width * zoom, height * zoom, stored);
+                export_image(image, zoom);
+            } else if (ext == ".ppm") {
+                PpmWriter image(file, width * zoom, height * zoom);
+                export_image(image, zoom);
+            } else if (ext == ".ans") {
+                export_ans(file);
+            } else throw std::invalid_argument(std::format("Unknown export format {}", ext).c_str());
+        }
+
+        /* Resamples every layer to width x height. */
+        void scale(uint width, uint height, ScaleMode mode) {
+            if (width == 0 || height == 0) throw std::invalid_argument("Can't scale to nothing");
+            update_lines.clear();
+
+            for (uint k = 0; k < layers.size(); k++) {
+                save_old(layers[k], k > 0);
+                Pixel* new_canvas = scaled(layers[k].pixels, width, height, mode);
+                delete[] layers[k].pixels;
+                layers[k].pixels = new_canvas;
+            }
+            canvas = layers[active].pixels;
             this->width = width;
             this->height = height;
-            canvas = new_canvas;
+
+            for (int i = 0; i < height; i++) touch(i);
         }
 
-        void display() {
-            for (const int& i : update_lines) {
-                std::string line;
-                for (int j = 0; j < width; j++) {
-                    const Pixel& c = canvas[i * width + j];
-                    Pixel r = c.get_reverse();
-                    switch (c.code) {
-                        case NONE: {
-                            std::string t = c.text.substr(0,2);
-                            if (t == "  ")
-                                line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m{}", c.r, c.g, c.b, r.r, r.g, r.b, t);
-                            else
-                                line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m{}", c.r, c.g, c.b, c.fg_r, c.fg_g, c.fg_b, t);
-                            break;
+        Pixel* scaled(const Pixel* canvas, uint width, uint height, ScaleMode mode) {
+            Pixel* new_canvas = new Pixel[(size_t)width * height];
+
+            if (mode != SCALE_BILINEAR && width % this->width == 0 && height % this->height == 0) {
+                // Enlarging by whole factors only repeats pixels, so every source row is widened once and copied
+                uint fx = width / this->width;
+                uint fy = height / this->height;
+                for (uint i = 0; i < this->height; i++) {
+                    Pixel* row = new_canvas + (size_t)i * fy * width;
+                    for (uint j = 0; j < width; j++) row[j] = canvas[(size_t)i * this->width + j / fx];
+                    for (uint k = 1; k < fy; k++) std::copy(row, row + width, row + k * width);
+                }
+                return new_canvas;
+            }
+
+            auto table = [mode](uint src, uint dst) {
+                return mode == SCALE_NEAREST ? ResampleTable::nearest(src, dst) :
+                       mode == SCALE_BILINEAR ? ResampleTable::bilinear(src, dst) : ResampleTable::area(src, dst);
+            };
+            ResampleTable cols = table(this->width, width);
+            ResampleTable rows = table(this->height, height);
+
+            auto scale_rows = [&](uint first, uint last) {
+                for (uint i = first; i < last; i++) {
+                    for (uint j = 0; j < width; j++) {
+                        Pixel& c = new_canvas[(size_t)i * width + j];
+                        if (mode == SCALE_NEAREST) {
+                            c = canvas[(size_t)rows.index[rows.start[i]] * this->width + cols.index[cols.start[j]]];
+                            continue;
+                        }
+
+                        // Transparent pixels have no color, so they only count towards how transparent the result is
+                        float r = 0, g = 0, b = 0, a = 0;
+                        for (uint s = rows.start[i]; s < rows.start[i + 1]; s++) {
+                            for (uint t = cols.start[j]; t < cols.start[j + 1]; t++) {
+                                const Pixel& p = canvas[(size_t)rows.index[s] * this->width + cols.index[t]];
+                                if (p.code == TRANSPARENT) continue;
+                                float w = rows.weight[s] * cols.weight[t];
+                                r += w * p.r;
+                                g += w * p.g;
+                                b += w * p.b;
+                                a += w;
+                            }
                         }
-                        case TRANSPARENT: line += "\033[0m  "; break;
-                        case BOUNDARY: line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m::", c.r, c.g, c.b, r.r, r.g, r.b); break;
-                        case TEMP: line += "\033[48;2;255;255;255m\033[38;0;0;0m##"; break;
-                        default: line += "  "; break;
+                        if (a >= .5f) c = Pixel(std::lround(r / a), std::lround(g / a), std::lround(b / a));
                     }
                 }
+            };
 
-                std::print("\033[{};{}H{}", i + 1, 1, line);
-            }
+            // Rows are independent, so they are split between threads
+            uint count = std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(1, (size_t)width * height / 4096));
+            std::vector<std::thread> threads;
+            for (uint k = 1; k < count; k++) threads.emplace_back(scale_rows, height * k / count, height * (k + 1) / count);
+            scale_rows(0, height / count);
+            for (std::thread& t : threads) t.join();
+
+            return new_canvas;
         }
 
-        void draw() {
-            for (const int& i : update_lines) {
-                std::string line;
-                for (int j = 0; j < width; j++) {
-                    const Pixel& c = canvas[i * width + j];
-                    Pixel r = c.get_reverse();
-                    switch (c.code) {
-                        case NONE: {
-                            std::string t = c.text.substr(0,2);
-                            if (t == "  ")
-                                line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m{}", c.r, c.g, c.b, r.r, r.g, r.b, t);
-                            else
-                                line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m{}", c.r, c.g, c.b, c.fg_r, c.fg_g, c.fg_b, t);
-                            break;
+        /* The shown pixels shrunk to fit in a size x size square, keeping their proportions. Its dimensions are put
+         * in width and height. */
+        Pixel* thumbnail(uint size, uint& width, uint& height) {
+            double scale = std::min({1., (double)size / this->width, (double)size / this->height});
+            width = std::max(1l, std::lround(this->width * scale));
+            height = std::max(1l, std::lround(this->height * scale));
+            return scaled(shown(), width, height, SCALE_AREA);
+        }
+
+        /* Copies w x h pixels to dest, clipped to the canvas, without keeping the old ones for undo. */
+        void paste(const Pixel* pixels, uint w, uint h, Point<uint> dest) {
+            for (uint i = 0; i < h; i++) blit_row(OpaqueWrite(), pixels + i * w, 0, w - 1, dest.y + i, dest.x);
+        }
+
+        /* Blurs every layer. */
+        void blur(uint x_reduction, uint y_reduction) {
+            Task::run(blur_task(x_reduction, y_reduction));
+        }
+
+        /* Blurs every layer into new pixels a row at a time, which only replace the layers once all are done. */
+        Task* blur_task(uint x_reduction, uint y_reduction) {
+            uint new_height = height / y_reduction;
+            std::shared_ptr<std::vector<Pixel*>> out = std::make_shared<std::vector<Pixel*>>();
+            for (uint k = 0; k < layers.size(); k++) out->push_back(new Pixel[width / x_reduction * new_height]);
+
+            return new Task(layers.size() * new_height, [=, this](uint n) {
+                blur_row(layers[n / new_height].pixels, (*out)[n / new_height], n % new_height, x_reduction, y_reduction);
+            }, [=, this]() {
+                update_lines.clear();
+                for (uint k = 0; k < layers.size(); k++) {
+                    save_old(layers[k], k > 0);
+                    delete[] layers[k].pixels;
+                    layers[k].pixels = (*out)[k];
+                }
+                canvas = layers[active].pixels;
+                width /= x_reduction;
+                height /= y_reduction;
+
+                for (int i = 0; i < height; i++) touch(i);
+            }, [=]() {
+                for (Pixel* pixels : *out) delete[] pixels;
+            });
+        }
+
+        /* Finds row i of canvas blurred into new_canvas. */
+        void blur_row(const Pixel* canvas, Pixel* new_canvas, uint i, uint x_reduction, uint y_reduction) {
+            uint width = this->width / x_reduction;
+            uint r,g,b;
+            uint count;
+            bool is_trans;
+
+            for (int j = 0; j < width; j++) {
+                r = 0;
+                g = 0;
+                b = 0;
+                count = 0;
+                is_trans = true;
+
+                for (int k = i * y_reduction; k < i * y_reduction + y_reduction && k < this->height; k++) {
+                    for (int l = j * x_reduction; l < j * x_reduction + x_reduction && l < this->width; l++) {
+                        const Pixel& c = canvas[k * this->width + l];
+                        if (c.code != TRANSPARENT) {
+                            is_trans = false;
+                            r += c.r;
+                            g += c.g;
+                            b += c.b;
+                            count++;
                         }
-                        case TRANSPARENT: line += "\033[0m\033[38;2;255;255;255m.."; break;
-                        case BOUNDARY: line += std::format("\033[48;2;{};{};{}m\033[38;2;{};{};{}m::", c.r, c.g, c.b, r.r, r.g, r.b); break;
-                        case TEMP: line += "\033[48;2;255;255;255m\033[38;0;0;0m##"; break;
-                        default: line += "  "; break;
                     }
                 }
 
-                std::print("\033[{};{}H{}", i + 1, 1, line);
+                if (is_trans) new_canvas[i * width + j] = Pixel::transparent;
+                else new_canvas[i * width + j] = Pixel(r / count, g / count, b / count);
             }
+        }
+
+        static constexpr int MAX_SCALE = 16384; // The longest side a canvas can be scaled to
+
+        static bool half_blocks;
+        static Renderer* renderer;
+        static SharedCanvas* shared; // Where the editor publishes the canvas, if anywhere
+
+        /* The number of terminal columns and rows taken by a canvas of the given size. */
+        static uint screen_cols(uint width) { return half_blocks ? width : 2 * width; }
+        static uint screen_rows(uint height) { return half_blocks ? (height + 1) / 2 : height; }
+
+        void display() {
+            draw_rows(false, NULL);
+            update_lines.clear();
+        }
+
+        /* Displays only the pixels which differ from before, which is already on the screen. */
+        void display_changes(Canvas& before) {
+            if (before.width != width || before.height != height) {
+                display();
+                return;
+            }
+
+            const Pixel* pixels = shown();
+            const Pixel* previous = before.shown();
+            update_lines.clear();
+            for (uint i = 0; i < height; i++)
+                if (!std::equal(pixels + i * width, pixels + (i + 1) * width, previous + i * width)) update_lines.insert(i);
+            draw_rows(false, NULL, previous);
+            update_lines.clear();
+        }
+
+        /* Replaces line i without keeping the old one for undo. */
+        void set_line(uint i, const Pixel* pixels) {
+            std::copy(pixels, pixels + width, canvas + i * width);
+            touch(i);
+        }
+
+        /* Draws the updated lines in the editor. If onion is a snapshot of the same dimensions, it is shown
+         * underneath transparent pixels. */
+        void draw(const Snapshot* onion = NULL) {
+            if (onion != NULL && (onion->width != width || onion->height != height)) onion = NULL;
+
+            draw_rows(true, onion);
 
             update_lines.clear();
             reset_temp();
@@ -585,21 +3522,7 @@ class Canvas {
             check_point(end);
 
             save_old();
-
-            double delta = 1 / (double)fineness;
-            Point<double> b(start.x, start.y);
-            Point<double> e(end.x, end.y);
-            Point<double> d = Point((e.x - b.x), (e.y - b.y)) * delta;
-
-            for (int i = 0; i <= fineness; i++) {
-                Pixel& c = canvas[std::lround(b.y) * width + std::lround(b.x)];
-                if (c.code != BOUNDARY) {
-                    c.set_code(BOUNDARY);
-                    update_lines.insert(std::lround(b.y));
-                }
-                b += d;
-            }
-
+            line(BoundaryWrite(), start, end, Pixel::transparent, fineness);
             boundary_points.insert(Point(start, end));
         }
 
@@ -608,49 +3531,43 @@ class Canvas {
             check_point(end);
 
             save_old();
-
-            double delta = 1 / (double)fineness;
-            Point<double> b(start.x, start.y);
-            Point<double> e(end.x, end.y);
-            Point<double> d = Point((e.x - b.x), (e.y - b.y)) * delta;
-
-            for (int i = 0; i <= fineness; i++) {
-                canvas[std::lround(b.y) * width + std::lround(b.x)] = c;
-                update_lines.insert(std::lround(b.y));
-                b += d;
-            }
-
-            if (c.code != TEMP) reset_temp();
+            with_write(c, [&](auto write) { line(write, start, end, c, fineness); });
         }
 
         void fill_bg(Pixel c) {
             save_old();
 
             for (int i = 0; i < height; i++) {
-                update_lines.insert(i);
-                for (int j = 0; j < width; j++) {
-                    Pixel& curr = canvas[i * width + j];
-                    if (curr.code == TRANSPARENT) curr = c;
+                Extent e = extent(i);
+                if (e.empty()) { // Everything in the row is transparent
+                    span(OpaqueWrite(), i, 0, width - 1, c);
+                    continue;
                 }
+                span(OpaqueWrite(), i, 0, (int)e.first - 1, c);
+                span(BehindWrite(), i, e.first, e.last, c);
+                span(OpaqueWrite(), i, e.last + 1, width - 1, c);
             }
         }
 
         void fill_area(Point<uint> p, Pixel c) {
-            check_point(p);
-
-            save_old();
+            Task::run(fill_area_task(p, c));
+        }
 
-            for (int i = 0; i < width; i++) {
-                for (int j = 0; j < height; j++) {
-                    Pixel& curr = canvas[j * width + i];
-                    if (in_area(p, Point<uint>(i, j)) || curr.code == BOUNDARY) {
-                        curr = c;
-                        update_lines.insert(j);
-                    }
-                }
-            }
+        /* Fills the area around p a column at a time. Every pixel is tested against every boundary line, so this
+         * is slow with many of them. */
+        Task* fill_area_task(Point<uint> p, Pixel c) {
+            check_point(p);
 
-            if (c.code != TEMP) reset_temp();
+            save_old();
+
+            return new Task(width, [=, this](uint i) {
+                with_write(c, [&](auto write) {
+                    for (int j = 0; j < height; j++) {
+                        if ((in_area(p, Point<uint>(i, j)) || canvas[j * width + i].code == BOUNDARY) && mask().contains(i, j))
+                            plot(write, j, i, c);
+                    }
+                });
+            }, NULL, [this]() { undo(); });
         }
 
         void draw_circle(Point<uint> p, uint r, Pixel c) {
@@ -658,20 +3575,17 @@ class Canvas {
 
             save_old();
 
-            for (int i = 0; i < width; i++) {
-                for (int j = 0; j < height; j++) {
-                    int dx = i - p.x;
-                    int dy = j - p.y;
-                    int a = dx * dx + dy * dy;
-                    int r2 = r * r;
-                    if (r2 - r <= a && a <= r2 + r) {
-                        canvas[j * width + i] = c;
-                        update_lines.insert(j);
+            with_write(c, [&](auto write) {
+                for (int i = 0; i < width; i++) {
+                    for (int j = 0; j < height; j++) {
+                        int dx = i - p.x;
+                        int dy = j - p.y;
+                        int a = dx * dx + dy * dy;
+                        int r2 = r * r;
+                        if (r2 - r <= a && a <= r2 + r) plot(write, j, i, c);
                     }
                 }
-            }
-
-            if (c.code != TEMP) reset_temp();
+            });
         }
 
         void draw_ellipse(Point<uint> p, int r1, int r2, Pixel c) {
@@ -693,50 +3607,47 @@ class Canvas {
                     int r = r1 * r2;
                     if (r * r - r * std::sqrt(r) <= a && a <= r * r + r * std::sqrt(r)) {
                         canvas[j * width + i] = c;
-                        update_lines.insert(j);
+                        touch(j);
                     }
                 }
             }*/
 
-            for (int i = 0; i < height; i++) {
-                for (int j = 0; j < width; j++) {
-                    Point<double> diffs[] = {Point<double>(-.5,.5), Point<double>(.5,.5), Point<double>(.5,-.5), Point<double>(-.5,-.5)};
-                    double vals[] = {0,0,0,0};
-                    for (int k = 0; k < 4; k++) {
-                        double dx = (double)j - p.x - diffs[k].x;
-                        double dy = (double)i - p.y - diffs[k].y;
-                        vals[k] = r22 * dx * dx + r12 * dy * dy;
-                    }
+            with_write(c, [&](auto write) {
+                for (int i = 0; i < height; i++) {
+                    for (int j = 0; j < width; j++) {
+                        Point<double> diffs[] = {Point<double>(-.5,.5), Point<double>(.5,.5), Point<double>(.5,-.5), Point<double>(-.5,-.5)};
+                        double vals[] = {0,0,0,0};
+                        for (int k = 0; k < 4; k++) {
+                            double dx = (double)j - p.x - diffs[k].x;
+                            double dy = (double)i - p.y - diffs[k].y;
+                            vals[k] = r22 * dx * dx + r12 * dy * dy;
+                        }
 
-                    int state = 0;
-                    bool flag = false;
-                    for (int k = 0; k < 4; k++) {
-                        if (vals[k] == r12 * r22) {
-                            flag = true;
-                            break;
-                        } else if (vals[k] < r12 * r22) {
-                            if (state == 1) {
-                                flag = true;
-                                break;
-                            }
-                            state = -1;
-                        } else if (vals[k] > r12 * r22) {
-                            if (state == -1) {
+                        int state = 0;
+                        bool flag = false;
+                        for (int k = 0; k < 4; k++) {
+                            if (vals[k] == r12 * r22) {
                                 flag = true;
                                 break;
+                            } else if (vals[k] < r12 * r22) {
+                                if (state == 1) {
+                                    flag = true;
+                                    break;
+                                }
+                                state = -1;
+                            } else if (vals[k] > r12 * r22) {
+                                if (state == -1) {
+                                    flag = true;
+                                    break;
+                                }
+                                state = 1;
                             }
-                            state = 1;
                         }
-                    }
 
-                    if (flag) {
-                        canvas[i * width + j] = c;
-                        update_lines.insert(i);
+                        if (flag) plot(write, i, j, c);
                     }
                 }
-            }
-
-            if (c.code != TEMP) reset_temp();
+            });
         }
 
         void fill_ellipse(Point<uint> p, int r1, int r2, Pixel c) {
@@ -750,51 +3661,42 @@ class Canvas {
             double r12 = r1 * r1;
             double r22 = r2 * r2;
 
-            for (int i = 0; i < height; i++) {
-                for (int j = 0; j <= width; j++) {
-                    Point<double> diffs[] = {Point<double>(-.5,.5), Point<double>(.5,.5), Point<double>(.5,-.5), Point<double>(-.5,-.5)};
-                    double vals[] = {0,0,0,0};
-                    for (int k = 0; k < 4; k++) {
-                        double dx = (double)j - p.x - diffs[k].x;
-                        double dy = (double)i - p.y - diffs[k].y;
-                        vals[k] = r22 * dx * dx + r12 * dy * dy;
-                    }
+            with_write(c, [&](auto write) {
+                for (int i = 0; i < height; i++) {
+                    for (int j = 0; j <= width; j++) {
+                        Point<double> diffs[] = {Point<double>(-.5,.5), Point<double>(.5,.5), Point<double>(.5,-.5), Point<double>(-.5,-.5)};
+                        double vals[] = {0,0,0,0};
+                        for (int k = 0; k < 4; k++) {
+                            double dx = (double)j - p.x - diffs[k].x;
+                            double dy = (double)i - p.y - diffs[k].y;
+                            vals[k] = r22 * dx * dx + r12 * dy * dy;
+                        }
 
-                    int state = 0;
-                    bool flag = false;
-                    for (int k = 0; k < 4; k++) {
-                        if (vals[k] == r12 * r22) {
-                            flag = true;
-                            break;
-                        } else if (vals[k] < r12 * r22) {
-                            if (state == 1) {
-                                flag = true;
-                                break;
-                            }
-                            state = -1;
-                        } else if (vals[k] > r12 * r22) {
-                            if (state == -1) {
+                        int state = 0;
+                        bool flag = false;
+                        for (int k = 0; k < 4; k++) {
+                            if (vals[k] == r12 * r22) {
                                 flag = true;
                                 break;
+                            } else if (vals[k] < r12 * r22) {
+                                if (state == 1) {
+                                    flag = true;
+                                    break;
+                                }
+                                state = -1;
+                            } else if (vals[k] > r12 * r22) {
+                                if (state == -1) {
+                                    flag = true;
+                                    break;
+                                }
+                                state = 1;
                             }
-                            state = 1;
                         }
-                    }
 
-                    if (flag) {
-                        if (j <= p.x) {
-                            for (int k = j; k <= 2 * p.x - j; k++)
-                                canvas[i * width + k] = c;
-                        } else {
-                            for (int k = j; k >= 2 * (int)p.x - j && k >= 0; k--)
-                                canvas[i * width + k] = c;
-                        }
-                        update_lines.insert(i);
+                        if (flag) span(write, i, std::min(j, 2 * (int)p.x - j), std::max(j, 2 * (int)p.x - j), c);
                     }
                 }
-            }
-
-            if (c.code != TEMP) reset_temp();
+            });
         }
 
         void fill_circle(Point<uint> p, uint r, Pixel c) {
@@ -802,32 +3704,798 @@ class Canvas {
 
             save_old();
 
-            for (int i = 0; i < width; i++) {
-                for (int j = 0; j < height; j++) {
-                    int dx = i - p.x;
-                    int dy = j - p.y;
-                    int a = dx * dx + dy * dy;
-                    int r2 = r * r;
-                    if (r2 - r <= a && a <= r2 + r) {
-                        update_lines.insert(j);
-                        if (i <= p.x) {
-                            for (int k = i; k <= 2 * p.x - i; k++)
-                                canvas[j * width + k] = c;
-                        } else {
-                            for (int k = i; k >= 2 * (int)p.x - i && k >= 0; k--)
-                                canvas[j * width + k] = c;
+            with_write(c, [&](auto write) {
+                for (int i = 0; i < width; i++) {
+                    for (int j = 0; j < height; j++) {
+                        int dx = i - p.x;
+                        int dy = j - p.y;
+                        int a = dx * dx + dy * dy;
+                        int r2 = r * r;
+                        if (r2 - r <= a && a <= r2 + r) span(write, j, std::min(i, 2 * (int)p.x - i), std::max(i, 2 * (int)p.x - i), c);
+                    }
+                }
+            });
+        }
+};
+
+bool Canvas::half_blocks = false;
+
+/* Turns the pixels of a canvas into output for the terminal. */
+class Renderer {
+    public:
+        virtual ~Renderer() {}
+
+        /* Draws the given lines of the canvas, where pixels are the pixels shown on the whole canvas. If previous
+         * isn't NULL, it holds the pixels already on the screen, and only those which differ need to be drawn. */
+        virtual void draw(Canvas& canvas, const Pixel* pixels, const LineSet& lines, bool editor, const Canvas::Snapshot* onion,
+                const Pixel* previous) = 0;
+
+        /* Forgets what was drawn, after the screen was cleared. */
+        virtual void reset() {}
+
+        /* Removes anything which clearing the screen wouldn't. */
+        virtual void finish() {}
+};
+
+/* Draws pixels as colored cells with escape sequences. */
+class AnsiRenderer : public Renderer {
+    public:
+        /* Two lines are drawn in every row of the screen in half block mode. */
+        void draw(Canvas& canvas, const Pixel* pixels, const LineSet& lines, bool editor, const Canvas::Snapshot* onion,
+                const Pixel* previous) override {
+            LineSet rows;
+            for (uint i : lines) rows.insert(Canvas::half_blocks ? i / 2 : i);
+
+            for (uint r : rows) {
+                if (previous != NULL) draw_changes(canvas, pixels, r, previous);
+                else Screen::write(std::format("\033[{};{}H", r + 1, 1) + canvas.encode_row(pixels, r, editor, onion), Screen::CANVAS_ROW + r);
+            }
+        }
+
+        /* Draws the cells of row r whose pixels changed. Runs of changed cells are drawn together, along with gaps
+         * too short to be worth moving the cursor over. */
+        void draw_changes(Canvas& canvas, const Pixel* pixels, uint r, const Pixel* previous) {
+            uint w = canvas.get_width();
+            uint y = Canvas::half_blocks ? 2 * r : r;
+            uint rows = Canvas::half_blocks && y + 1 < canvas.get_height() ? 2 : 1;
+            auto changed = [&](uint j) {
+                for (uint i = y; i < y + rows; i++) if (!(pixels[i * w + j] == previous[i * w + j])) return true;
+                return false;
+            };
+
+            std::string out;
+            for (uint j = 0; j < w;) {
+                if (!changed(j)) {
+                    j++;
+                    continue;
+                }
+                uint end = j + 1;
+                for (uint k = end; k < w && k < end + 4; k++) if (changed(k)) end = k + 1;
+
+                std::string line;
+                CellEncoder e(line);
+                for (uint k = j; k < end; k++) {
+                    uint i = y * w + k;
+                    if (!Canvas::half_blocks) pixels[i].encode(e, false, k, y);
+                    else Pixel::encode_half(e, pixels[i], rows > 1 ? &pixels[i + w] : NULL, false, k, y);
+                }
+                e.reset();
+                out += std::format("\033[{};{}H", r + 1, Canvas::screen_cols(j) + 1) + line;
+                j = end;
+            }
+            if (!out.empty()) Screen::write(out);
+        }
+};
+
+/* Draws the canvas as a single image with the kitty graphics protocol, which the terminal scales to the cells the
+ * canvas would take up. Images are sent as zlib compressed RGBA. After the first, only the rectangles which
+ * changed are sent, as edits of the image. The image is drawn below text so the cursor stays visible. */
+class KittyRenderer : public Renderer {
+    private:
+        static constexpr uint ID = 1;
+        static constexpr uint CHUNK = 4096; // The most base64 bytes in a single escape sequence
+
+        uint width;
+        uint height;
+        std::vector<uchar> sent; // The image which the terminal has
+
+        static std::string base64(const std::string& data) {
+            static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            std::string out;
+            out.reserve((data.size() + 2) / 3 * 4);
+            for (size_t i = 0; i < data.size(); i += 3) {
+                uint n = (uchar)data[i] << 16;
+                if (i + 1 < data.size()) n |= (uchar)data[i + 1] << 8;
+                if (i + 2 < data.size()) n |= (uchar)data[i + 2];
+                out += digits[n >> 18];
+                out += digits[n >> 12 & 63];
+                out += i + 1 < data.size() ? digits[n >> 6 & 63] : '=';
+                out += i + 2 < data.size() ? digits[n & 63] : '=';
+            }
+            return out;
+        }
+
+        /* A command carrying pixels, split into as many escape sequences as it takes. */
+        static std::string command(const std::string& keys, const std::vector<uchar>& rgba) {
+            std::string compressed;
+            Deflater deflater([&](const uchar* data, size_t n) { compressed.append(reinterpret_cast<const char*>(data), n); });
+            deflater.write(rgba.data(), rgba.size());
+            deflater.finish();
+
+            std::string payload = base64(compressed);
+            std::string out;
+            for (size_t i = 0; i < payload.size(); i += CHUNK) {
+                bool more = i + CHUNK < payload.size();
+                out += std::format("\033_G{}q=2,m={};{}\033\\", i == 0 ? keys + ",f=32,o=z," : "", (int)more, payload.substr(i, CHUNK));
+            }
+            return out;
+        }
+
+    public:
+        KittyRenderer() : width{0}, height{0} {}
+
+        void draw(Canvas& canvas, const Pixel* pixels, const LineSet& lines, bool editor, const Canvas::Snapshot* onion,
+                const Pixel* previous) override {
+            uint w = canvas.get_width();
+            uint h = canvas.get_height();
+            bool full = sent.empty() || w != width || h != height;
+            auto fill = [&](uchar* rgba, uint i) {
+                for (uint j = 0; j < w; j++)
+                    pixels[i * w + j].rgba(&rgba[4 * j], editor, j, i, onion != NULL ? &onion->pixels[i * w + j] : NULL);
+            };
+
+            // Text (such as the editor's cursor) is written over the image, so the cells of the lines are blanked
+            // even when their pixels are the same
+            std::string out;
+            std::string blank(Canvas::screen_cols(w), ' ');
+            int blanked = -1;
+            for (uint i : lines) {
+                if (i >= h) break;
+                int row = Canvas::screen_rows(i + 1) - 1;
+                if (row != blanked) out += std::format("{}\033[{};1H{}", blanked < 0 ? "\033[0m" : "", row + 1, blank);
+                blanked = row;
+            }
+
+            if (full) {
+                sent.assign(4 * w * h, 0);
+                for (uint i = 0; i < h; i++) fill(&sent[4 * i * w], i);
+                out += std::format("\033[1;1H") + command(std::format("a=T,i={},p=1,s={},v={},c={},r={},C=1,z=-1", ID, w, h,
+                        Canvas::screen_cols(w), Canvas::screen_rows(h)), sent);
+            } else {
+                // Consecutive changed lines are sent together, as the smallest rectangle covering their changes. Only
+                // those lines of the sent image are replaced.
+                std::vector<uchar> block;
+                for (auto it = lines.begin(); it != lines.end();) {
+                    uint top = *it, bottom = top;
+                    uint left = w, right = 0;
+                    block.clear();
+                    for (; it != lines.end() && *it == bottom && bottom < h; it++, bottom++) {
+                        block.resize(block.size() + 4 * w);
+                        uchar* row = &block[block.size() - 4 * w];
+                        fill(row, bottom);
+                        for (uint j = 0; j < w; j++) {
+                            if (std::equal(row + 4 * j, row + 4 * j + 4, &sent[4 * (bottom * w + j)])) continue;
+                            left = std::min(left, j);
+                            right = std::max(right, j);
                         }
                     }
+                    if (it != lines.end() && *it >= h) it = lines.end();
+                    if (left > right) continue;
+
+                    std::copy(block.begin(), block.end(), &sent[4 * top * w]);
+                    std::vector<uchar> rect;
+                    for (uint i = 0; i < bottom - top; i++)
+                        rect.insert(rect.end(), &block[4 * (i * w + left)], &block[4 * (i * w + right) + 4]);
+                    out += command(std::format("a=f,i={},r=1,x={},y={},s={},v={}", ID, left, top, right - left + 1, bottom - top), rect);
+                }
+            }
+
+            width = w;
+            height = h;
+            if (!out.empty()) Screen::write(out);
+        }
+
+        void reset() override { sent.clear(); }
+
+        void finish() override {
+            Screen::write(std::format("\033_Ga=d,d=I,i={},q=2\033\\", ID));
+            sent.clear();
+        }
+};
+
+Renderer* Canvas::renderer = new AnsiRenderer();
+
+/* A canvas published in POSIX shared memory, so other processes can follow an editing session. The segment holds a
+ * header, a version for every line and the pixels. Writes are guarded by a seqlock: the sequence number is odd
+ * while lines are written, and readers retry if it was odd or changed while they read. The editor never waits for
+ * readers, or even knows about them. */
+class SharedCanvas {
+    private:
+        struct Cell {
+            uchar r, g, b;
+            uchar code;
+            uchar fg_r, fg_g, fg_b;
+            char text[2];
+        };
+
+        struct Header {
+            char magic[8];
+            uint capacity;            // Cells
+            uint line_capacity;
+            pid_t pid;
+            std::atomic<uint> state;  // LIVE, ENDED, or MOVED when the segment was replaced by a larger one
+            std::atomic<uint64_t> seq;
+            uint width;
+            uint height;
+        };
+
+        static constexpr char MAGIC[8] = "tartshm";
+        enum State { LIVE, ENDED, MOVED };
+
+        std::string name;
+        bool owner;
+        Header* header;
+        size_t size;
+        uint64_t version;
+
+        uint64_t* versions() { return reinterpret_cast<uint64_t*>(header + 1); }
+        Cell* cells() { return reinterpret_cast<Cell*>(versions() + header->line_capacity); }
+
+        /* Creates the segment, which mustn't exist already. */
+        void create(uint capacity, uint line_capacity) {
+            size = sizeof(Header) + line_capacity * sizeof(uint64_t) + capacity * sizeof(Cell);
+            int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+            if (fd < 0 || ftruncate(fd, size) < 0) {
+                if (fd >= 0) close(fd);
+                throw std::invalid_argument(std::format("Can't create {}: {}", name, std::strerror(errno)).c_str());
+            }
+            map(fd);
+            new (header) Header{{}, capacity, line_capacity, getpid(), LIVE, 0, 0, 0};
+            std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+        }
+
+        /* Removes a segment left under the name by an editor which crashed. One whose editor is still running is
+         * kept, so two sessions are never mixed together. */
+        void remove_stale() {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) return;
+            struct stat st;
+            pid_t pid = 0;
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(Header)) {
+                void* p = mmap(NULL, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) {
+                    const Header* h = static_cast<const Header*>(p);
+                    if (std::memcmp(h->magic, MAGIC, sizeof(MAGIC)) == 0 && h->state == LIVE) pid = h->pid;
+                    munmap(p, sizeof(Header));
+                }
+            }
+            close(fd);
+
+            if (pid > 0 && (kill(pid, 0) == 0 || errno == EPERM))
+                throw std::invalid_argument(std::format("{} is in use by process {}", name, pid).c_str());
+            shm_unlink(name.c_str());
+        }
+
+        void open() {
+            int fd = shm_open(name.c_str(), O_RDONLY, 0);
+            if (fd < 0) throw std::invalid_argument(std::format("Can't open {}: {}", name, std::strerror(errno)).c_str());
+            struct stat st;
+            if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Header)) {
+                close(fd);
+                throw std::invalid_argument(std::format("{} isn't a shared canvas", name).c_str());
+            }
+            size = st.st_size;
+            map(fd);
+            if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 ||
+                    size < sizeof(Header) + header->line_capacity * sizeof(uint64_t) + header->capacity * sizeof(Cell)) {
+                unmap();
+                throw std::invalid_argument(std::format("{} isn't a shared canvas", name).c_str());
+            }
+        }
+
+        void map(int fd) {
+            void* p = mmap(NULL, size, owner ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) throw std::invalid_argument(std::format("Can't map {}: {}", name, std::strerror(errno)).c_str());
+            header = static_cast<Header*>(p);
+        }
+
+        void unmap() {
+            if (header != NULL) munmap(header, size);
+            header = NULL;
+        }
+
+    public:
+        /* The editor creates the segment, and followers open it read only. */
+        SharedCanvas(std::string name, bool owner) : name{"/tart-" + name}, owner{owner}, header{NULL}, size{0}, version{0} {
+            if (owner) {
+                remove_stale();
+                create(256 * 256, 256);
+            } else open();
+        }
+
+        ~SharedCanvas() {
+            if (header != NULL && owner) {
+                header->state = ENDED;
+                shm_unlink(name.c_str());
+            }
+            unmap();
+        }
+
+        /* Publishes the given lines, or every line if the size of the canvas changed. */
+        void publish(uint width, uint height, const Pixel* pixels, const LineSet& lines) {
+            if (width * height > header->capacity || height > header->line_capacity) {
+                // Followers still have the old segment mapped, and open the new one when they see it moved
+                Header* old = header;
+                size_t old_size = size;
+                shm_unlink(name.c_str());
+                create(std::max(2 * width * height, header->capacity), std::max(2 * height, header->line_capacity));
+                old->state = MOVED;
+                munmap(old, old_size);
+            }
+
+            bool all = width != header->width || height != header->height;
+            uint64_t seq = header->seq.load(std::memory_order_relaxed);
+            header->seq.store(seq + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+
+            header->width = width;
+            header->height = height;
+            version++;
+            auto write_line = [&](uint i) {
+                for (uint j = 0; j < width; j++) {
+                    const Pixel& p = pixels[i * width + j];
+                    Cell& c = cells()[i * width + j];
+                    c = Cell{p.r, p.g, p.b, (uchar)p.code, p.fg_r, p.fg_g, p.fg_b, {p.text[0], p.text.size() > 1 ? p.text[1] : ' '}};
+                }
+                versions()[i] = version;
+            };
+            if (all) for (uint i = 0; i < height; i++) write_line(i);
+            else for (uint i : lines) if (i < height) write_line(i);
+
+            header->seq.store(seq + 2, std::memory_order_release);
+        }
+
+        /* Copies the lines which changed since seen into canvas, resizing it if needed. Returns false if the
+         * editor has exited. */
+        bool follow(Canvas& canvas, std::vector<uint64_t>& seen) {
+            while (true) {
+                if (header->state == MOVED) {
+                    unmap();
+                    open();
+                    seen.clear();
+                }
+                if (header->state == ENDED || (kill(header->pid, 0) < 0 && errno == ESRCH)) return false;
+
+                uint64_t seq = header->seq.load(std::memory_order_acquire);
+                if (seq % 2 == 1) {
+                    std::this_thread::yield();
+                    continue;
+                }
+
+                uint width = header->width;
+                uint height = header->height;
+                if (width * height > header->capacity || height > header->line_capacity) continue;
+                bool resized = width != canvas.get_width() || height != canvas.get_height();
+                if (resized) seen.clear();
+                seen.resize(height, 0);
+
+                std::vector<std::pair<uint, uint64_t>> changed;
+                std::vector<Pixel> lines;
+                for (uint i = 0; i < height; i++) {
+                    uint64_t v = versions()[i];
+                    if (v == seen[i]) continue;
+                    changed.push_back({i, v});
+                    for (uint j = 0; j < width; j++) {
+                        const Cell& c = cells()[i * width + j];
+                        lines.push_back(Pixel(c.r, c.g, c.b, c.fg_r, c.fg_g, c.fg_b, std::string(c.text, 2), (PixelCode)c.code));
+                    }
+                }
+
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (header->seq.load(std::memory_order_relaxed) != seq) continue;
+
+                if (resized && width > 0 && height > 0) canvas.restore(Canvas::Snapshot(width, height, std::vector<Pixel>(width * height)));
+                for (uint k = 0; k < changed.size(); k++) {
+                    canvas.set_line(changed[k].first, &lines[k * width]);
+                    seen[changed[k].first] = changed[k].second;
+                }
+                return true;
+            }
+        }
+};
+
+SharedCanvas* Canvas::shared = NULL;
+
+void Canvas::draw_rows(bool editor, const Snapshot* onion, const Pixel* previous) {
+    const Pixel* pixels = shown();
+    renderer->draw(*this, pixels, update_lines, editor, onion, previous);
+    if (shared != NULL) shared->publish(width, height, pixels, update_lines);
+}
+
+/* Animations are stored as a full keyframe followed by delta frames, which only hold the cells that changed since
+ * the previous frame. Every frame has its own delay in milliseconds. */
+struct Animation {
+    struct Frame {
+        uint delay;
+        std::vector<uint> cells;
+        std::vector<Pixel> pixels;
+
+        Frame(uint delay) : delay{delay} {}
+    };
+
+    uint width;
+    uint height;
+    uint keyframe_delay;
+    std::vector<Pixel> keyframe;
+    std::vector<Frame> deltas;
+
+    static Frame diff(const std::vector<Pixel>& from, const std::vector<Pixel>& to, uint delay) {
+        Frame f(delay);
+        for (uint i = 0; i < to.size(); i++) {
+            if (from[i] == to[i]) continue;
+            f.cells.push_back(i);
+            f.pixels.push_back(to[i]);
+        }
+        return f;
+    }
+
+    static void apply(std::vector<Pixel>& pixels, const Frame& f) {
+        for (uint i = 0; i < f.cells.size(); i++) pixels[f.cells[i]] = f.pixels[i];
+    }
+
+    static bool is_animation(std::string filename) {
+        std::ifstream input_file(filename, std::ios::binary | std::ios::in);
+        std::string vno;
+        std::getline(input_file, vno, '\0');
+        return vno == anim_version_no;
+    }
+
+    Animation(const std::vector<Canvas::Snapshot>& frames, const std::vector<uint>& delays) :
+        width{frames[0].width}, height{frames[0].height}, keyframe_delay{delays[0]}, keyframe{frames[0].pixels}
+    {
+        for (int i = 1; i < frames.size(); i++) {
+            if (frames[i].width != width || frames[i].height != height)
+                throw std::invalid_argument(std::format("Frame {} is {}x{} instead of {}x{}", i, frames[i].width, frames[i].height, width, height).c_str());
+            deltas.push_back(diff(frames[i - 1].pixels, frames[i].pixels, delays[i]));
+        }
+    }
+
+    Animation(std::string filename) {
+        std::ifstream input_file;
+        input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+        input_file.open(filename, std::ios::binary | std::ios::in);
+
+        std::string vno;
+        std::getline(input_file, vno, '\0');
+        if (vno != anim_version_no) throw std::invalid_argument(std::format("Invalid version: current {} vs {}", anim_version_no, vno).c_str());
+
+        uint frames, delay, changed;
+        input_file.read(reinterpret_cast<char*>(&width), sizeof(width));
+        input_file.read(reinterpret_cast<char*>(&height), sizeof(height));
+        input_file.read(reinterpret_cast<char*>(&frames), sizeof(frames));
+        input_file.read(reinterpret_cast<char*>(&keyframe_delay), sizeof(keyframe_delay));
+        input_file.read(reinterpret_cast<char*>(&changed), sizeof(changed));
+
+        keyframe.reserve(width * height);
+        for (int i = 0; i < width * height; i++) keyframe.push_back(Pixel::read(input_file));
+
+        for (int i = 1; i < frames; i++) {
+            input_file.read(reinterpret_cast<char*>(&delay), sizeof(delay));
+            input_file.read(reinterpret_cast<char*>(&changed), sizeof(changed));
+
+            Frame f(delay);
+            for (int j = 0; j < changed; j++) {
+                uint cell;
+                input_file.read(reinterpret_cast<char*>(&cell), sizeof(cell));
+                if (cell >= width * height) throw std::invalid_argument(std::format("Invalid cell {} in frame {}", cell, i).c_str());
+                f.cells.push_back(cell);
+                f.pixels.push_back(Pixel::read(input_file));
+            }
+            deltas.push_back(std::move(f));
+        }
+    }
+
+    void save(std::string filename) {
+        write_atomically(filename, [&](std::ostream& output) { write(output); });
+    }
+
+    void write(std::ostream& output_file) {
+        uint frames = deltas.size() + 1;
+        uint changed = width * height;
+        output_file << anim_version_no << '\0';
+        output_file.write(reinterpret_cast<char*>(&width), sizeof(width));
+        output_file.write(reinterpret_cast<char*>(&height), sizeof(height));
+        output_file.write(reinterpret_cast<char*>(&frames), sizeof(frames));
+        output_file.write(reinterpret_cast<char*>(&keyframe_delay), sizeof(keyframe_delay));
+        output_file.write(reinterpret_cast<char*>(&changed), sizeof(changed));
+        for (const Pixel& c : keyframe) c.write(output_file);
+
+        for (Frame& f : deltas) {
+            changed = f.cells.size();
+            output_file.write(reinterpret_cast<char*>(&f.delay), sizeof(f.delay));
+            output_file.write(reinterpret_cast<char*>(&changed), sizeof(changed));
+            for (int i = 0; i < changed; i++) {
+                output_file.write(reinterpret_cast<char*>(&f.cells[i]), sizeof(f.cells[i]));
+                f.pixels[i].write(output_file);
+            }
+        }
+    }
+
+    std::vector<Canvas::Snapshot> to_snapshots() {
+        std::vector<Canvas::Snapshot> frames;
+        std::vector<Pixel> pixels = keyframe;
+
+        frames.push_back(Canvas::Snapshot(width, height, pixels));
+        for (const Frame& f : deltas) {
+            apply(pixels, f);
+            frames.push_back(Canvas::Snapshot(width, height, pixels));
+        }
+        return frames;
+    }
+
+    std::vector<uint> delays() {
+        std::vector<uint> delays = {keyframe_delay};
+        for (const Frame& f : deltas) delays.push_back(f.delay);
+        return delays;
+    }
+};
+
+/* Plays animations on a monotonic clock. Only the cells changed by a frame are emitted, and if the terminal falls
+ * behind, frames are dropped while their changes are carried over to the next frame that is shown. */
+class Player {
+    private:
+        static volatile sig_atomic_t stop;
+
+        Animation& anim;
+        std::vector<Pixel> curr;
+        std::vector<uchar> dirty;
+        std::vector<uchar> dirty_rows;
+
+        static void sigint_handler(int signum) {
+            stop = 1;
+        }
+
+        void apply(const Animation::Frame& f) {
+            for (uint i = 0; i < f.cells.size(); i++) {
+                curr[f.cells[i]] = f.pixels[i];
+                dirty[f.cells[i]] = 1;
+                dirty_rows[f.cells[i] / anim.width] = 1;
+            }
+        }
+
+        void emit() {
+            std::string out;
+            CellEncoder e(out);    // Nothing else is written while playing, so colors carry over between runs
+
+            for (uint i = 0; i < anim.height; i++) {
+                if (!dirty_rows[i]) continue;
+                dirty_rows[i] = 0;
+
+                for (uint j = 0; j < anim.width; j++) {
+                    if (!dirty[i * anim.width + j]) continue;
+                    out += std::format("\033[{};{}H", i + 1, 2 * j + 1);
+                    for (; j < anim.width && dirty[i * anim.width + j]; j++) {
+                        curr[i * anim.width + j].encode(e, false, j, i);
+                        dirty[i * anim.width + j] = 0;
+                    }
+                }
+            }
+
+            std::cout << out << std::flush;
+        }
+
+    public:
+        Player(Animation& anim) : anim{anim}, curr{anim.keyframe}, dirty(anim.width * anim.height, 1), dirty_rows(anim.height, 1) {}
+
+        void play(bool loop) {
+            using clock = std::chrono::steady_clock;
+
+            std::vector<const Animation::Frame*> order;
+            for (const Animation::Frame& f : anim.deltas) order.push_back(&f);
+
+            Animation::Frame back(anim.keyframe_delay);
+            if (loop && !order.empty()) {
+                std::vector<Pixel> last = anim.keyframe;
+                for (const Animation::Frame& f : anim.deltas) Animation::apply(last, f);
+                back = Animation::diff(last, anim.keyframe, anim.keyframe_delay);
+                order.push_back(&back);
+            }
+
+            stop = 0;
+            std::signal(SIGINT, Player::sigint_handler);
+            std::cout << "\033[2J\033[H\033[?25l";
+            emit();
+
+            clock::time_point next = clock::now() + std::chrono::milliseconds(anim.keyframe_delay);
+            uint i = 0;
+            while (i < order.size() && !stop) {
+                const Animation::Frame& f = *order[i];
+                clock::time_point shown = next;
+                next += std::chrono::milliseconds(f.delay);
+                apply(f);
+
+                i++;
+                if (i == order.size() && loop) i = 0;
+
+                if (clock::now() < next || i == order.size()) {
+                    std::this_thread::sleep_until(shown);
+                    emit();
                 }
             }
+
+            std::cout << std::format("\033[0m\033[{};1H\033[?25h", anim.height + 1) << std::endl;
         }
 };
 
+volatile sig_atomic_t Player::stop = 0;
+
+/* The help, built into the binary so it is shown wherever TermiArt is run from. */
+const char help_text[] = R"(Welcome to TermiArt!
+
+Usage: ./termiart [--help] [--dimens <width> <height>] [--file <filename>] [--display <filename>... [--watch]] [--play <filename> [--loop]] [--publish <name>] [--follow <name>] [--recover <log>] [--record <filename>] [--replay <filename>] [--import <image>] [--import-ansi <filename>] [--output <filename> [--zoom <n>] [--stored] [--scale <width> <height> <mode>] [--adjust <adjustment>]...] [--colors <256|16|truecolor> [--dither]] [--half-blocks] [--kitty] [--scroll-regions]
+
+Flags:
+    --help: print this help message.
+    --dimens <width> <height>: create a new pixel art of the given dimensions.
+    --file <filename>: load a pixel art from <filename>
+    --display <filename>...: display pixel art from <filename>. Given more than one file (or a glob or directory),
+        shows them all as thumbnails with their names, shrunk to fit the terminal.
+    --watch: with --display of a single file, keep showing the file, redrawing only the pixels which changed whenever it is written.
+    --play <filename>: play the animation in <filename>, dropping frames if the terminal falls behind.
+    --loop: loop the animation given to --play until interrupted.
+    --publish <name>: publish the canvas of the editor under <name>, so it can be watched with --follow.
+    --follow <name>: show the canvas of the editor published under <name> as it changes, until the editor exits.
+    --recover <log>: continue the drawing in the log left behind when the editor crashed while editing a new
+        drawing (e.g. untitled-1234.tart.log). Drawings opened with --file are recovered from <file>.log anyway.
+    --record <filename>: record the keys typed in the editor to <filename>, with when they were typed.
+    --replay <filename>: replay a session recorded with --record without a terminal, starting from the canvas it
+        started with. Prints how long each frame took (percentiles), the bytes written and a hash of the canvas.
+        Give the same --colors, --half-blocks and --kitty flags as the recording to get the same output.
+    --import <image>: create a pixel art from a PPM, PGM or PNG image, resampled to the size given by --dimens.
+        Without --dimens the image is shrunk to fit the terminal.
+    --import-ansi <filename>: create a pixel art from ANSI art (UTF-8 or code page 437), two cells to a pixel
+        (or half a cell with --half-blocks). Without --dimens the pixel art is the size of the art.
+    --output <filename>: save the pixel art from --file, --import or --import-ansi to <filename> instead of opening the editor.
+        Files ending with .png, .ppm or .ans are exported as images or escape sequences.
+    --zoom <n>: with --output, export every pixel as an <n> x <n> square.
+    --scale <width> <height> <nearest|bilinear|area>: with --output, resample the pixel art to <width> x <height>.
+    --adjust <adjustment>: with --output, adjust the colors before writing, e.g. --adjust "hue 120". May be given
+        more than once. See "adjust" in the editor's terminal help for the adjustments.
+    --stored: with --output, write PNG files without compressing them (faster, but larger).
+    --colors <256|16|truecolor>: the colors used for output (truecolor by default). Fewer colors need fewer bytes,
+        and work in terminals without truecolor support.
+    --dither: with --colors 256 or 16, dither colors which aren't in the palette.
+    --half-blocks: show two pixels in every terminal cell with half block characters, so twice as much of the
+        canvas fits on the screen. Text isn't shown in this mode.
+    --kitty: draw the canvas in the editor and with --display as an image, with the kitty graphics protocol. This
+        needs far fewer bytes than colored cells, but only works in terminals which support the protocol (e.g. kitty),
+        and text isn't shown.
+    --scroll-regions: scroll the output window with terminal scroll regions (needs left/right margin support, e.g. xterm).
+
+For help with commands within the editor, go to the editor's terminal (press '/') and enter "help".
+)";
+
+const char editor_help_text[] = R"(Navigation: using 'w', 'a', 's', 'd'
+    '0': goto first column
+    '$': goto last column
+    'g': goto first row
+    'G': goto last row
+Access terminal: '/'
+    enter "help terminal" for terminal help
+Draw: ' ' (space) -- this will draw a point or finish the current shape.
+Begin line: 'l'
+Begin circle: 'c'
+Begin ellipse: 'e'
+Begin circle fill: 'C'
+Begin ellipse fill: 'E'
+Begin boundary line: 'b'
+Fill boundary lines: 'F' (warning: does not work)
+Begin fill area: 'f'
+Begin move area: 'm' (space to end move area, then space to move to current point)
+)";
+
+const char terminal_help_text[] = R"(quit: quits the program.
+help [<option>]:
+    help: prints help on the editor.
+    help terminal: prints this help message on the terminal.
+resize <width> <height>: resizes the editor to <width> x <height>
+trim: crops the canvas to the smallest rectangle holding everything which isn't transparent (at least 4 x 4).
+scroll <number>: scrolls up/down <number> lines in the output window.
+print <string>: prints <string> in the output window, words beginning with $ are expanded as variables.
+    These are:
+    $cursor: the cursor position.
+    $color: the color under the cursor.
+    $dimensions: the dimensions of the canvas.
+    $frame: the current frame and the number of frames.
+    $version: the current version of termiart.
+    $credits: credits.
+undo [<times>]: undoes the past <times> actions (if empty, then 1).
+cursor [<x> <y>]: if <x> <y> is empty then prints the cursor position.
+    Otherwise, sets the cursor position to (<x>,<y>).
+color [<r> <g> <b>] [transparent]:
+    color <r> <g> <b>: sets the current color to rgb(<r>,<g>,<b>).
+    color transparent: sets the current color to transparent.
+text <text>: adds text in the current color to the current position in the canvas.
+draw <shape> [...]:
+    draw line <x1> <y1> <x2> <y2>: draws a line from (<x1>, <y1>) to (<x2>, <y2>).
+    draw circle <x> <y> <r>: draws a circle of radius <r> around (<x>, <y>).
+    draw boundary <x1> <y1> <x2> <y2>: draws a boundary line from (<x1>, <y1>) to (<x2>, <y2>).
+    draw point <x> <y>: draws the pixel at (<x>, <y>).
+    draw ellipse <x> <y> <rx> <ry>: draws an ellipse with radii <rx> and <ry> around (<x>, <y>).
+fill <shape> [...]:
+    fill circle <x> <y> <r>: fills in a circle of radius <r> around (<x>, <y>).
+    fill area <x1> <y1> <x2> <y2>: fills the rectangular area between (<x1>, <y1>) and (<x2>, <y2>).
+    fill ellipse <x> <y> <rx> <ry>: fills in an ellipse with radii <rx> and <ry> around (<x>, <y>).
+    fill flood <x> <y>: fills the area of the same color around (<x>, <y>).
+    fill bg: fills the background (all transparent pixels).
+    Large flood fills show their progress and can be cancelled with Esc, as can blur and insert.
+insert <filename>: inserts the pixel art in <filename> at the current position.
+import <filename> [<width> <height>]: imports a PPM, PGM or PNG image at the current position,
+    resampled to <width> x <height> (the size of the canvas by default).
+import-ansi <filename>: imports ANSI art at the current position. Block characters become their colors,
+    text is kept, and cells in the terminal's background leave the canvas as it was.
+export <filename> [<zoom>] [stored]: exports the canvas to a .png, .ppm or .ans file.
+    Every pixel becomes a <zoom> x <zoom> square, and stored writes an uncompressed PNG.
+save <filename>: saves the current canvas in a file of the name <filename>, in the background.
+    Changes are also logged to <file>.log, which is replayed when the file is opened again if the editor
+    crashes. New drawings log to untitled-<pid>.tart.log, which is only replayed with --recover.
+scale <width> <height> [nearest|bilinear|area]: resamples the canvas to <width> x <height> (nearest by default).
+    nearest keeps pixels sharp, bilinear interpolates between them, and area averages them (best for shrinking).
+move <x1> <y1> <x2> <y2> <x3> <y3>: moves the area between (<x1>, <y1>) and (<x2>, <y2>) to (<x3>, <y3>)
+select [add|intersect|subtract] <shape> [...]:
+    select rect <x1> <y1> <x2> <y2>: selects the rectangular area between (<x1>, <y1>) and (<x2>, <y2>).
+    select ellipse <x> <y> <rx> <ry>: selects an ellipse with radii <rx> and <ry> around (<x>, <y>).
+    select lasso <x1> <y1> <x2> <y2> <x3> <y3> ...: selects the inside of the polygon through the points.
+    select wand <x> <y> [<tolerance>]: selects the area around (<x>, <y>) whose colors differ from it by
+        at most <tolerance> (0 by default) in every channel.
+    select clear: clears the selection.
+    With add, intersect or subtract the shape is combined with the current selection instead of replacing it.
+    Fills and moves only change selected pixels. Nothing selected means everything is.
+adjust <adjustment>: adjusts the colors of the selected pixels (or the whole canvas). Adjustments are:
+    invert: inverts the colors.
+    grayscale: turns the colors gray.
+    brightness <amount>: adds <amount> (from -255 to 255) to every channel.
+    contrast <percent>: scales the distance of every channel from the middle by <percent>.
+    hue <degrees>: rotates the hue by <degrees>.
+    swap <order>: reorders the channels, e.g. swap bgr swaps red and blue.
+    remap <r1> <g1> <b1> <r2> <g2> <b2> ...: replaces every rgb(<r1>, <g1>, <b1>) with rgb(<r2>, <g2>, <b2>),
+        for any number of pairs of colors.
+    Transparent pixels and boundaries aren't changed.
+frame <action> [...]:
+    frame add: adds a copy of the current frame after it, and moves to the copy.
+    frame delete: deletes the current frame.
+    frame next, frame prev: moves to the next or previous frame.
+    frame goto <n>: moves to frame <n> (counting from 0).
+    frame delay <ms>: sets how long the current frame is shown for when playing.
+layer <action> [...]:
+    layer add <name>: adds an empty layer above the current one, and moves to it.
+    layer delete: deletes the current layer.
+    layer select <n>: moves to layer <n> (counting from 0 at the bottom).
+    layer up, layer down: moves the current layer up or down the stack.
+    layer show, layer hide: shows or hides the current layer.
+    layer opacity <percent>: sets the opacity of the current layer.
+    layer blend <normal|multiply|add>: sets how the current layer is blended with the layers under it.
+    layer rename <name>: renames the current layer.
+    layer list: lists the layers, from the top down.
+    Drawing happens on the current layer. Adding, deleting or moving layers clears the undo history,
+    and animations are saved with their layers flattened.
+onion <on|off>: shows the previous frame underneath transparent pixels.
+)";
+
 class Drawer;
 
+/* How a command is recorded in the drawing's log. Commands which depend on other files can't be replayed reliably,
+ * so a checkpoint of the whole drawing is logged after them instead, as it is after an undo which goes back past the
+ * last checkpoint. */
+enum LogMode { LOG_NONE, LOG_APPEND, LOG_CHECKPOINT };
+
 struct Command {
+    std::string line; // The text the command was parsed from
     Command() {}
+    virtual ~Command() = default;
     virtual void execute(Drawer& d) =0;
+    virtual LogMode log_mode() { return LOG_NONE; }
 };
 
 struct QuitCommand : public Command {
@@ -836,8 +4504,8 @@ struct QuitCommand : public Command {
 };
 
 struct HelpCommand : public Command {
-    std::string fname;
-    HelpCommand(std::string fname) : fname{fname} {}
+    const char* text;
+    HelpCommand(const char* text) : text{text} {}
     void execute(Drawer& d) override;
 };
 
@@ -846,6 +4514,12 @@ struct ResizeCommand : public Command {
     uint height;
     ResizeCommand(uint width, uint height) : width{width}, height{height} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct TrimCommand : public Command {
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct ScrollCommand : public Command {
@@ -863,8 +4537,10 @@ struct OutputCommand : public Command {
 
 struct UndoCommand : public Command {
     int times;
-    UndoCommand(int times = 1) : times{times} {}
+    LogMode mode;
+    UndoCommand(int times = 1) : times{times}, mode{LOG_APPEND} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return mode; }
 };
 
 struct CursorCommand : public Command {
@@ -884,6 +4560,7 @@ struct AddTextCommand : public Command {
     std::string text;
     AddTextCommand(std::string text) : text{text} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct DrawLineCommand : public Command {
@@ -891,6 +4568,7 @@ struct DrawLineCommand : public Command {
     Point<uint> e;
     DrawLineCommand(Point<uint> b, Point<uint> e) : b{b}, e{e} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct DrawBoundaryLineCommand : public Command {
@@ -898,6 +4576,7 @@ struct DrawBoundaryLineCommand : public Command {
     Point<uint> e;
     DrawBoundaryLineCommand(Point<uint> b, Point<uint> e) : b{b}, e{e} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct DrawCircleCommand : public Command {
@@ -905,6 +4584,7 @@ struct DrawCircleCommand : public Command {
     uint r;
     DrawCircleCommand(Point<uint> p, uint r) : p{p}, r{r} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct FillCircleCommand : public Command {
@@ -912,6 +4592,7 @@ struct FillCircleCommand : public Command {
     uint r;
     FillCircleCommand(Point<uint> p, uint r) : p{p}, r{r} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
 struct FillAreaCommand : public Command {
@@ -919,38 +4600,146 @@ struct FillAreaCommand : public Command {
     Point<uint> p2;
     FillAreaCommand(Point<uint> p1, Point<uint> p2) : p1{p1}, p2{p2} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct PointCommand : public Command {
+    Point<uint> p;
+    PointCommand(Point<uint> p) : p{p} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct DrawEllipseCommand : public Command {
+    Point<uint> p;
+    int rx;
+    int ry;
+    bool fill;
+    DrawEllipseCommand(Point<uint> p, int rx, int ry, bool fill) : p{p}, rx{rx}, ry{ry}, fill{fill} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct FloodFillCommand : public Command {
+    Point<uint> p;
+    FloodFillCommand(Point<uint> p) : p{p} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct FillBGCommand : public Command {
+    FillBGCommand() {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct MoveCommand : public Command {
+    Point<uint> p1;
+    Point<uint> p2;
+    Point<uint> p3;
+    MoveCommand(uint x1, uint y1, uint x2, uint y2, uint x3, uint y3) :
+        p1(x1,y1), p2(x2,y2), p3(x3,y3) {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct BlurCommand : public Command {
+    uint x_reduction;
+    uint y_reduction;
+    BlurCommand(uint x_reduction, uint y_reduction) : x_reduction{x_reduction}, y_reduction{y_reduction} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
+};
+
+struct InsertCommand : public Command {
+    std::string filename;
+    InsertCommand(std::string filename) : filename{filename} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_CHECKPOINT; }
+};
+
+struct SaveCommand : public Command {
+    std::string filename;
+    SaveCommand(std::string filename) : filename{filename} {}
+    void execute(Drawer& d) override;
+};
+
+struct ImportCommand : public Command {
+    std::string filename;
+    uint width;
+    uint height;
+    ImportCommand(std::string filename, uint width = 0, uint height = 0) : filename{filename}, width{width}, height{height} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_CHECKPOINT; }
+};
+
+struct ImportAnsiCommand : public Command {
+    std::string filename;
+    ImportAnsiCommand(std::string filename) : filename{filename} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_CHECKPOINT; }
+};
+
+struct ExportCommand : public Command {
+    std::string filename;
+    uint zoom;
+    bool stored;
+    ExportCommand(std::string filename, uint zoom = 1, bool stored = false) : filename{filename}, zoom{zoom}, stored{stored} {}
+    void execute(Drawer& d) override;
+};
+
+enum FrameAction { FRAME_ADD, FRAME_DELETE, FRAME_NEXT, FRAME_PREV, FRAME_GOTO, FRAME_DELAY };
+
+struct FrameCommand : public Command {
+    FrameAction action;
+    uint arg;
+    FrameCommand(FrameAction action, uint arg = 0) : action{action}, arg{arg} {}
+    void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
-struct FillBGCommand : public Command {
-    FillBGCommand() {}
+struct ScaleCommand : public Command {
+    uint width;
+    uint height;
+    ScaleMode mode;
+    ScaleCommand(uint width, uint height, ScaleMode mode) : width{width}, height{height}, mode{mode} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
-struct MoveCommand : public Command {
-    Point<uint> p1;
-    Point<uint> p2;
-    Point<uint> p3;
-    MoveCommand(uint x1, uint y1, uint x2, uint y2, uint x3, uint y3) :
-        p1(x1,y1), p2(x2,y2), p3(x3,y3) {}
+struct AdjustCommand : public Command {
+    ColorAdjustment adjustment;
+    AdjustCommand(ColorAdjustment adjustment) : adjustment{adjustment} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
-struct BlurCommand : public Command {
-    uint x_reduction;
-    uint y_reduction;
-    BlurCommand(uint x_reduction, uint y_reduction) : x_reduction{x_reduction}, y_reduction{y_reduction} {}
+enum SelectShape { SELECT_RECT, SELECT_ELLIPSE, SELECT_LASSO, SELECT_WAND, SELECT_CLEAR };
+
+struct SelectCommand : public Command {
+    SelectShape shape;
+    SelectOp op;
+    std::vector<int> args;
+    SelectCommand(SelectShape shape, SelectOp op = SELECT_REPLACE, std::vector<int> args = {}) : shape{shape}, op{op}, args{args} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return LOG_APPEND; }
 };
 
-struct InsertCommand : public Command {
-    std::string filename;
-    InsertCommand(std::string filename) : filename{filename} {}
+enum LayerAction { LAYER_ADD, LAYER_DELETE, LAYER_SELECT, LAYER_UP, LAYER_DOWN, LAYER_SHOW, LAYER_HIDE, LAYER_OPACITY, LAYER_BLEND,
+                   LAYER_RENAME, LAYER_LIST };
+
+struct LayerCommand : public Command {
+    LayerAction action;
+    uint arg;
+    std::string name;
+    LayerCommand(LayerAction action, uint arg = 0, std::string name = "") : action{action}, arg{arg}, name{name} {}
     void execute(Drawer& d) override;
+    LogMode log_mode() override { return action == LAYER_LIST ? LOG_NONE : LOG_APPEND; }
 };
 
-struct SaveCommand : public Command {
-    std::string filename;
-    SaveCommand(std::string filename) : filename{filename} {}
+struct OnionCommand : public Command {
+    bool on;
+    OnionCommand(bool on) : on{on} {}
     void execute(Drawer& d) override;
 };
 
@@ -996,6 +4785,251 @@ std::vector<std::string> split_string(std::string s, std::string delimiter) {
     return res;
 }
 
+/* The input of an editing session, recorded so it can be replayed without a terminal to reproduce how the editor
+ * performed. A recording starts with the size of the terminal and the state of the editor, followed by every key
+ * with when it was read and every change to the size of the terminal. Keys read while a task was running also
+ * store how many of its chunks had run, so a replay stops the task at the same point to read them. */
+class Session {
+    public:
+        static const uint IDLE = -1; // The chunk stored for keys which were read while no task was running
+
+    private:
+        static const uchar KEY = 0;
+        static const uchar SIZE = 1;
+
+        struct Event {
+            uint64_t time; // Microseconds since the session started
+            uchar type;
+            char key;
+            uint chunk;
+            ushort rows;
+            ushort cols;
+        };
+
+        /* Counts what is written to std::cout during a replay, instead of writing it. */
+        class Counter : public std::streambuf {
+            public:
+                size_t bytes = 0;
+
+            protected:
+                int overflow(int c) override {
+                    if (c != traits_type::eof()) bytes++;
+                    return traits_type::not_eof(c);
+                }
+
+                std::streamsize xsputn(const char* s, std::streamsize n) override {
+                    bytes += n;
+                    return n;
+                }
+        };
+
+        static std::ofstream output;
+        static bool replay;
+        static std::vector<Event> events;
+        static size_t next;
+        static std::string state;
+        static ushort rows;
+        static ushort cols;
+        static std::chrono::steady_clock::time_point start;
+        static std::chrono::steady_clock::time_point delivered; // When the last event of a replay was read
+        static bool waiting;                                    // For the editor to handle that event
+        static std::vector<double> latencies;                   // In milliseconds
+        static Counter counter;
+        static std::streambuf* stdout_buf;
+
+        static uint64_t now() {
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        static void write(const Event& e) {
+            if (!output.is_open()) return;
+            output.write(reinterpret_cast<const char*>(&e.time), sizeof(e.time));
+            output.put(e.type);
+            if (e.type == KEY) {
+                output.put(e.key);
+                output.write(reinterpret_cast<const char*>(&e.chunk), sizeof(e.chunk));
+            } else {
+                output.write(reinterpret_cast<const char*>(&e.rows), sizeof(e.rows));
+                output.write(reinterpret_cast<const char*>(&e.cols), sizeof(e.cols));
+            }
+            output.flush(); // So the keys leading up to a crash are kept
+        }
+
+    public:
+        /* Records the session to filename, starting once the editor calls begin. */
+        static void record(std::string filename) {
+            output.open(filename, std::ios::binary | std::ios::out | std::ios::trunc);
+            if (!output) throw std::invalid_argument(std::format("Can't open {}: {}", filename, std::strerror(errno)).c_str());
+        }
+
+        /* Loads a recording to replay instead of reading the keyboard. What the editor writes is only counted. */
+        static void replay_file(std::string filename) {
+            std::ifstream input_file;
+            input_file.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+            input_file.open(filename, std::ios::binary | std::ios::in);
+
+            std::string vno;
+            std::getline(input_file, vno, '\0');
+            if (vno != session_version_no) throw std::invalid_argument(std::format("Invalid version: current {} vs {}", session_version_no, vno).c_str());
+
+            uint size;
+            input_file.read(reinterpret_cast<char*>(&rows), sizeof(rows));
+            input_file.read(reinterpret_cast<char*>(&cols), sizeof(cols));
+            input_file.read(reinterpret_cast<char*>(&size), sizeof(size));
+            state.resize(size);
+            input_file.read(state.data(), size);
+
+            input_file.exceptions(std::ifstream::badbit);
+            while (true) {
+                Event e = {};
+                if (!input_file.read(reinterpret_cast<char*>(&e.time), sizeof(e.time))) break;
+                e.type = input_file.get();
+                if (e.type == KEY) {
+                    e.key = input_file.get();
+                    input_file.read(reinterpret_cast<char*>(&e.chunk), sizeof(e.chunk));
+                } else {
+                    input_file.read(reinterpret_cast<char*>(&e.rows), sizeof(e.rows));
+                    input_file.read(reinterpret_cast<char*>(&e.cols), sizeof(e.cols));
+                }
+                if (!input_file) break; // Cut off by a crash
+                events.push_back(e);
+            }
+
+            replay = true;
+            stdout_buf = std::cout.rdbuf(&counter);
+        }
+
+        static bool replaying() { return replay; }
+
+        /* The state of the editor when the recording started. */
+        static const std::string& get_state() { return state; }
+
+        /* The size of the terminal in a replay. */
+        static void get_size(int& rows, int& cols) {
+            rows = Session::rows;
+            cols = Session::cols;
+        }
+
+        /* Starts the clock, and writes the size of the terminal and the state of the editor if recording. */
+        static void begin(const std::string& editor_state) {
+            start = std::chrono::steady_clock::now();
+            if (!output.is_open()) return;
+            uint size = editor_state.size();
+            output << session_version_no << '\0';
+            output.write(reinterpret_cast<const char*>(&rows), sizeof(rows));
+            output.write(reinterpret_cast<const char*>(&cols), sizeof(cols));
+            output.write(reinterpret_cast<const char*>(&size), sizeof(size));
+            output << editor_state;
+            output.flush();
+        }
+
+        /* Called with the size of the terminal whenever it is queried, to record the changes. */
+        static void size_changed(int rows, int cols) {
+            if (rows == Session::rows && cols == Session::cols) return;
+            Session::rows = rows;
+            Session::cols = cols;
+            if (start != std::chrono::steady_clock::time_point()) write(Event{now(), SIZE, 0, 0, (ushort)rows, (ushort)cols});
+        }
+
+        /* Reads the next key, like read(2). A replay raises SIGWINCH for changes to the size of the terminal, and
+         * measures how long the editor took to handle every event before asking for the next. */
+        static int read(char& c) {
+            if (!replay) {
+                ssize_t n = ::read(STDIN_FILENO, &c, 1);
+                if (n < 0 && errno != EINTR) return 0;
+                if (n == 1) write(Event{now(), KEY, c, IDLE, 0, 0});
+                return n;
+            }
+
+            auto t = std::chrono::steady_clock::now();
+            if (waiting) latencies.push_back(std::chrono::duration<double, std::milli>(t - delivered).count());
+            waiting = false;
+            if (next == events.size()) return 0;
+
+            const Event& e = events[next++];
+            delivered = t;
+            waiting = true;
+            if (e.type == SIZE) {
+                rows = e.rows;
+                cols = e.cols;
+                std::raise(SIGWINCH);
+                return -1;
+            }
+            c = e.key;
+            return 1;
+        }
+
+        /* Reads a key while a task is running, which has run chunk of its chunks so far, waiting at most timeout
+         * milliseconds for one. */
+        static bool read_during(uint chunk, char& c, int timeout = 0) {
+            if (replay) {
+                if (next == events.size() || events[next].type != KEY || events[next].chunk > chunk) return false;
+                c = events[next++].key;
+                return true;
+            }
+
+            struct pollfd in = {STDIN_FILENO, POLLIN, 0};
+            if (poll(&in, 1, timeout) <= 0 || !(in.revents & POLLIN) || ::read(STDIN_FILENO, &c, 1) != 1) return false;
+            write(Event{now(), KEY, c, chunk, 0, 0});
+            return true;
+        }
+
+        /* The chunk a replayed task has to stop after, so the next key is read at the same point as it was in the
+         * recording. Tasks otherwise run to the end in a replay, rather than a slice at a time. */
+        static uint stop_chunk() {
+            if (!replay || next == events.size() || events[next].type != KEY) return IDLE;
+            return events[next].chunk;
+        }
+
+        /* Stops counting the output of a replay, and describes how it went. */
+        static std::string report(uint hash) {
+            std::cout.rdbuf(stdout_buf);
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            double recorded = events.empty() ? 0 : events.back().time / 1e6;
+
+            std::sort(latencies.begin(), latencies.end());
+            auto percentile = [](double p) {
+                if (latencies.empty()) return 0.;
+                return latencies[std::min<size_t>(p * latencies.size(), latencies.size() - 1)];
+            };
+
+            return std::format("Replayed {} events in {:.2f}s (recorded over {:.2f}s)\n"
+                               "Frame latency: p50 {:.3f}ms, p90 {:.3f}ms, p99 {:.3f}ms, max {:.3f}ms\n"
+                               "Bytes written: {}\n"
+                               "Canvas hash: {:08x}\n",
+                               next, elapsed, recorded, percentile(0.5), percentile(0.9), percentile(0.99), percentile(1),
+                               counter.bytes, hash);
+        }
+};
+
+std::ofstream Session::output;
+bool Session::replay = false;
+std::vector<Session::Event> Session::events;
+size_t Session::next = 0;
+std::string Session::state;
+ushort Session::rows = 0;
+ushort Session::cols = 0;
+std::chrono::steady_clock::time_point Session::start;
+std::chrono::steady_clock::time_point Session::delivered;
+bool Session::waiting = false;
+std::vector<double> Session::latencies;
+Session::Counter Session::counter;
+std::streambuf* Session::stdout_buf = NULL;
+
+/* Keys which were read early (e.g. while a long operation was running), and are returned before any others. */
+std::deque<char> typeahead;
+
+/* Reads a single byte from the keyboard. Returns 1 on success, 0 at the end of input, and -1 if the read was
+ * interrupted by a signal (such as SIGWINCH) so the caller can handle it before reading again. */
+int read_key(char& c) {
+    if (!typeahead.empty()) {
+        c = typeahead.front();
+        typeahead.pop_front();
+        return 1;
+    }
+    return Session::read(c);
+}
+
 class OutputTerminal {
     private:
         Point<uint> pos;
@@ -1003,36 +5037,163 @@ class OutputTerminal {
         Pixel fg;
         uint width;
         uint height;
-        std::vector<std::string> lines;
+        std::vector<std::string> lines; // Ring buffer of already wrapped lines
+        uint head;                      // Index of the oldest line in the ring
+        uint count;
+        uint max_lines;
         int first_line;
+        std::deque<std::string> entries; // Unwrapped output, only needed when the width changes
+
+        int text_width() { return width > 2 ? width - 2 : 1; }
+        int text_height() { return height > 2 ? height - 2 : 0; }
+
+        const std::string& line_at(uint i) { return lines[(head + i) % max_lines]; }
+
+        /* Texts which never change (the help), with their lines as they were last wrapped. */
+        struct Wrapped {
+            int width;
+            std::vector<std::string> lines;
+        };
+
+        static std::unordered_map<const char*, Wrapped> static_texts;
+
+        /* Wraps output and pushes it into the ring, returning how many of the oldest lines were dropped. */
+        uint wrap(std::string output) {
+            entries.push_back(output);
+            if (entries.size() > max_lines) entries.pop_front();
+            return push(split_string_to_lines(output, text_width()));
+        }
+
+        uint push(const std::vector<std::string>& wrapped) {
+            uint dropped = 0;
+
+            for (const std::string& line : wrapped) {
+                if (count < max_lines) {
+                    lines[(head + count) % max_lines] = line;
+                    count++;
+                } else {
+                    lines[head] = line;
+                    head = (head + 1) % max_lines;
+                    dropped++;
+                }
+            }
+
+            return dropped;
+        }
+
+        std::string row(int i) {
+            int l = first_line + i - 1;
+            std::string text = " ";
+            if (1 <= i && i <= text_height() && 0 <= l && l < count) text += line_at(l);
+            if (text.length() < width) text += std::string(width - text.length(), ' ');
+            return std::format("\033[{};{}H{}", pos.y + i + 1, pos.x + 1, text);
+        }
+
+        /* Brings line to the top of the pane. Lines before fresh are assumed to already be on the screen at the
+         * current position, so when the view moves they are shifted with a scroll region (DECSTBM together with
+         * DECSLRM for the pane's columns) and only the exposed rows are drawn. */
+        void view(int line, int fresh) {
+            if (line >= (int)count) line = (int)count - 1;
+            if (line < 0) line = 0;
+
+            int dy = line - first_line;
+            bool scrolled = dy == 0 || (scroll_regions && std::abs(dy) < text_height());
+            std::string out = bg.bg() + fg.fg();
+
+            if (dy != 0 && scrolled) {
+                out += std::format("\033[?69h\033[{};{}r\033[{};{}s", pos.y + 2, pos.y + text_height() + 1, pos.x + 1, pos.x + width);
+                out += std::format("\033[{}{}\033[?69l\033[r", std::abs(dy), dy > 0 ? 'S' : 'T');
+            }
+
+            first_line = line;
+            for (int i = 1; i <= text_height(); i++) {
+                int l = first_line + i - 1;
+                int old_row = i + dy;
+                if (scrolled && 1 <= old_row && old_row <= text_height() && (l < fresh || l >= (int)count)) continue;
+                out += row(i);
+            }
+
+            Screen::write(out);
+        }
 
     public:
-        OutputTerminal(Point<uint> pos, uint width, uint height, Pixel bg, Pixel fg) : pos{pos}, width{width}, height{height}, bg{bg}, fg{fg}, first_line{0}
+        static bool scroll_regions;
+
+        OutputTerminal(Point<uint> pos, uint width, uint height, Pixel bg, Pixel fg, uint max_lines = 4096) :
+            pos{pos}, width{width}, height{height}, bg{bg}, fg{fg}, lines(max_lines), head{0}, count{0}, max_lines{max_lines}, first_line{0}
             {}
 
         void draw() {
-            std::string line = std::string(width, ' ');
-
-            std::print("{}{}", bg.bg(), fg.fg());
-            for (int i = 1; i <= height; i++)
-                std::print("\033[{};{}H{}", pos.y + i, pos.x + 1, line);
-            for (int i = 0; i < std::min((uint)lines.size() - (uint)first_line, height - 2); i++)
-                std::print("\033[{};{}H{}", pos.y + i + 2, pos.x + 2, lines[i + first_line]);
+            std::string out = bg.bg() + fg.fg();
+            for (int i = 0; i < (int)height; i++) out += row(i);
+            Screen::write(out);
         }
 
         void draw(std::string output) {
-            lines = split_string_to_lines(output, width - 2);
+            clear();
+            wrap(output);
             draw();
         }
 
-        void move(int dy) {
-            first_line += dy;
-            if (first_line < 0) first_line = 0;
-            else if (first_line >= lines.size()) first_line = lines.size() - 1;
+        /* Like draw, but the text is only wrapped the first time it is shown at the pane's width. */
+        void draw_static(const char* text) {
+            clear();
+            Wrapped& w = static_texts[text];
+            if (w.width != text_width()) w = Wrapped{text_width(), split_string_to_lines(text, text_width())};
+            entries.push_back(text);
+            push(w.lines);
             draw();
         }
+
+        void clear() {
+            head = 0;
+            count = 0;
+            first_line = 0;
+            entries.clear();
+        }
+
+        /* Moves the pane without drawing it. The output is only rewrapped if the width changed. */
+        bool set_geometry(Point<uint> pos, uint width, uint height) {
+            if (this->pos == pos && this->width == width && this->height == height) return false;
+
+            bool rewrap = this->width != width;
+            bool at_end = first_line + text_height() >= (int)count;
+            this->pos = pos;
+            this->width = width;
+            this->height = height;
+
+            if (rewrap) {
+                std::deque<std::string> old_entries;
+                std::swap(old_entries, entries);
+                head = 0;
+                count = 0;
+                for (std::string& entry : old_entries) wrap(entry);
+            }
+
+            if (at_end) first_line = std::max((int)count - text_height(), 0);
+            else if (first_line >= (int)count) first_line = std::max((int)count - 1, 0);
+            return true;
+        }
+
+        /* Appends output after the existing lines without rewrapping them. If the last line was visible, the
+         * view follows the end of the output. */
+        void append(std::string output) {
+            bool at_end = first_line + text_height() >= (int)count;
+            int old_count = count;
+            int dropped = wrap(output);
+
+            first_line -= dropped;
+            view(at_end ? (int)count - text_height() : first_line, old_count - dropped);
+        }
+
+        void move(int dy) {
+            view(first_line + dy, count);
+        }
 };
 
+bool OutputTerminal::scroll_regions = false;
+std::unordered_map<const char*, OutputTerminal::Wrapped> OutputTerminal::static_texts;
+
 class Terminal {
     private:
         Point<uint> pos;
@@ -1042,18 +5203,20 @@ class Terminal {
         uint height;
         std::string command;
 
-        Command* to_command() {
+        static Command* to_command(std::string command) {
             std::vector<std::string> strs = split_string(command, " ");
 
             if (strs[0] == "quit") {
                 return new QuitCommand();
             } if (strs[0] == "help") {
                 if (strs.size() > 1 && strs[1] == "terminal")
-                    return new HelpCommand("help-terminal.txt");
-                return new HelpCommand("help-editor.txt");
+                    return new HelpCommand(terminal_help_text);
+                return new HelpCommand(editor_help_text);
             } else if (strs[0] == "resize") {
                 if (strs.size() < 3) return NULL;
                 return new ResizeCommand(std::stoi(strs[1]), std::stoi(strs[2]));
+            } else if (strs[0] == "trim") {
+                return new TrimCommand();
             } else if (strs[0] == "scroll") {
                 if (strs.size() < 2) return NULL;
                 return new ScrollCommand(std::stoi(strs[1]));
@@ -1090,6 +5253,12 @@ class Terminal {
                 } else if (strs[1] == "boundary") {
                     if (strs.size() < 6) return NULL;
                     return new DrawBoundaryLineCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])), Point<uint>(std::stoi(strs[4]), std::stoi(strs[5])));
+                } else if (strs[1] == "point") {
+                    if (strs.size() < 4) return NULL;
+                    return new PointCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])));
+                } else if (strs[1] == "ellipse") {
+                    if (strs.size() < 6) return NULL;
+                    return new DrawEllipseCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])), std::stoi(strs[4]), std::stoi(strs[5]), false);
                 }
             } else if (strs[0] == "fill") {
                 if (strs.size() < 2) return NULL;
@@ -1099,6 +5268,12 @@ class Terminal {
                 } else if (strs[1] == "area") {
                     if (strs.size() < 6) return NULL;
                     return new FillAreaCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])), Point<uint>(std::stoi(strs[4]), std::stoi(strs[5])));
+                } else if (strs[1] == "ellipse") {
+                    if (strs.size() < 6) return NULL;
+                    return new DrawEllipseCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])), std::stoi(strs[4]), std::stoi(strs[5]), true);
+                } else if (strs[1] == "flood") {
+                    if (strs.size() < 4) return NULL;
+                    return new FloodFillCommand(Point<uint>(std::stoi(strs[2]), std::stoi(strs[3])));
                 } else if (strs[1] == "bg") return new FillBGCommand();
             } else if (strs[0] == "move") {
                 if (strs.size() < 7) return NULL;
@@ -1112,11 +5287,103 @@ class Terminal {
             } else if (strs[0] == "save") {
                 if (strs.size() < 2) return NULL;
                 return new SaveCommand(strs[1]);
+            } else if (strs[0] == "import") {
+                if (strs.size() < 2) return NULL;
+                if (strs.size() < 4) return new ImportCommand(strs[1]);
+                int width = std::stoi(strs[2]), height = std::stoi(strs[3]);
+                if (width <= 0 || height <= 0) return NULL;
+                return new ImportCommand(strs[1], width, height);
+            } else if (strs[0] == "import-ansi") {
+                if (strs.size() < 2) return NULL;
+                return new ImportAnsiCommand(command.substr(12));
+            } else if (strs[0] == "export") {
+                if (strs.size() < 2) return NULL;
+                bool stored = strs.back() == "stored";
+                if (stored) strs.pop_back();
+                if (strs.size() < 3) return new ExportCommand(strs[1], 1, stored);
+                int zoom = std::stoi(strs[2]);
+                if (zoom <= 0) return NULL;
+                return new ExportCommand(strs[1], zoom, stored);
+            } else if (strs[0] == "frame") {
+                if (strs.size() < 2) return NULL;
+                if (strs[1] == "add") return new FrameCommand(FRAME_ADD);
+                else if (strs[1] == "delete") return new FrameCommand(FRAME_DELETE);
+                else if (strs[1] == "next") return new FrameCommand(FRAME_NEXT);
+                else if (strs[1] == "prev") return new FrameCommand(FRAME_PREV);
+                if (strs.size() < 3) return NULL;
+                int arg = std::stoi(strs[2]);
+                if (arg < 0) return NULL;
+                if (strs[1] == "goto") return new FrameCommand(FRAME_GOTO, arg);
+                else if (strs[1] == "delay") return new FrameCommand(FRAME_DELAY, arg);
+            } else if (strs[0] == "scale") {
+                if (strs.size() < 3) return NULL;
+                ScaleMode mode = SCALE_NEAREST;
+                if (strs.size() > 3) {
+                    if (strs[3] == "bilinear") mode = SCALE_BILINEAR;
+                    else if (strs[3] == "area") mode = SCALE_AREA;
+                    else if (strs[3] != "nearest") return NULL;
+                }
+                int width = std::stoi(strs[1]), height = std::stoi(strs[2]);
+                if (width <= 0 || height <= 0 || width > Canvas::MAX_SCALE || height > Canvas::MAX_SCALE) return NULL;
+                return new ScaleCommand(width, height, mode);
+            } else if (strs[0] == "adjust") {
+                try {
+                    return new AdjustCommand(ColorAdjustment(std::vector<std::string>(strs.begin() + 1, strs.end())));
+                } catch (std::invalid_argument& e) {
+                    return NULL;
+                }
+            } else if (strs[0] == "select") {
+                if (strs.size() < 2) return NULL;
+                if (strs[1] == "clear") return new SelectCommand(SELECT_CLEAR);
+
+                SelectOp op = SELECT_REPLACE;
+                uint k = 2;
+                if (strs[1] == "add") op = SELECT_ADD;
+                else if (strs[1] == "intersect") op = SELECT_INTERSECT;
+                else if (strs[1] == "subtract") op = SELECT_SUBTRACT;
+                else k = 1;
+                if (strs.size() <= k) return NULL;
+
+                std::vector<int> args;
+                for (uint i = k + 1; i < strs.size(); i++) args.push_back(std::stoi(strs[i]));
+                if (strs[k] == "rect" && args.size() == 4) return new SelectCommand(SELECT_RECT, op, args);
+                else if (strs[k] == "ellipse" && args.size() == 4) return new SelectCommand(SELECT_ELLIPSE, op, args);
+                else if (strs[k] == "lasso" && args.size() >= 6 && args.size() % 2 == 0) return new SelectCommand(SELECT_LASSO, op, args);
+                else if (strs[k] == "wand" && (args.size() == 2 || args.size() == 3)) return new SelectCommand(SELECT_WAND, op, args);
+            } else if (strs[0] == "layer") {
+                if (strs.size() < 2) return NULL;
+                if (strs[1] == "delete") return new LayerCommand(LAYER_DELETE);
+                else if (strs[1] == "up") return new LayerCommand(LAYER_UP);
+                else if (strs[1] == "down") return new LayerCommand(LAYER_DOWN);
+                else if (strs[1] == "show") return new LayerCommand(LAYER_SHOW);
+                else if (strs[1] == "hide") return new LayerCommand(LAYER_HIDE);
+                else if (strs[1] == "list") return new LayerCommand(LAYER_LIST);
+                if (strs.size() < 3) return NULL;
+                if (strs[1] == "add" || strs[1] == "rename") {
+                    std::string name = command.substr(command.find(strs[1]) + strs[1].length() + 1);
+                    return new LayerCommand(strs[1] == "add" ? LAYER_ADD : LAYER_RENAME, 0, name);
+                } else if (strs[1] == "select") return new LayerCommand(LAYER_SELECT, std::stoi(strs[2]));
+                else if (strs[1] == "opacity") return new LayerCommand(LAYER_OPACITY, std::min(std::stoi(strs[2]), 100) * 255 / 100);
+                else if (strs[1] == "blend") {
+                    if (strs[2] == "normal") return new LayerCommand(LAYER_BLEND, BLEND_NORMAL);
+                    else if (strs[2] == "multiply") return new LayerCommand(LAYER_BLEND, BLEND_MULTIPLY);
+                    else if (strs[2] == "add") return new LayerCommand(LAYER_BLEND, BLEND_ADD);
+                }
+            } else if (strs[0] == "onion") {
+                if (strs.size() < 2) return NULL;
+                return new OnionCommand(strs[1] == "on");
             }
             return NULL;
         }
 
     public:
+        /* Parses a command line, returning NULL if it isn't a valid command. */
+        static Command* parse(std::string command) {
+            Command* c = to_command(command);
+            if (c != NULL) c->line = command;
+            return c;
+        }
+
         Terminal(Point<uint> pos, uint width, uint height, Pixel bg, Pixel fg) : pos{pos}, width{width}, height{height}, bg{bg}, fg{fg}, command{"Type / and then enter \"help\" for help"}
             {}
 
@@ -1124,24 +5391,38 @@ class Terminal {
             std::vector<std::string> lines = split_string_to_lines(command, width - 2);
             std::string line = std::string(width, ' ');
 
-            std::print("{}{}", bg.bg(), fg.fg());
+            std::string out = bg.bg() + fg.fg();
             for (int i = 1; i <= height; i++)
-                std::print("\033[{};{}H{}", pos.y + i, pos.x + 1, line);
+                out += std::format("\033[{};{}H{}", pos.y + i, pos.x + 1, line);
             for (int i = 0; i < lines.size(); i++)
-                std::print("\033[{};{}H{}", pos.y + i + 2, pos.x + 2, lines[i]);
+                out += std::format("\033[{};{}H{}", pos.y + i + 2, pos.x + 2, lines[i]);
+            Screen::write(out);
         }
 
         void clear() { command = ""; }
 
-        Command* main() {
+        bool set_geometry(Point<uint> pos, uint width, uint height) {
+            if (this->pos == pos && this->width == width && this->height == height) return false;
+            this->pos = pos;
+            this->width = width;
+            this->height = height;
+            return true;
+        }
+
+        Command* main(std::function<void()> on_interrupt) {
             char c;
 
             while (true) {
                 draw();
+                while (!Screen::present()) std::this_thread::yield(); // Nothing else hands the line to the screen
 
-                std::cin.get(c);
+                int n = read_key(c);
+                if (n < 0) {
+                    on_interrupt();
+                    continue;
+                } else if (n == 0) return NULL;
 
-                if (c == '\n') return to_command();
+                if (c == '\n') return parse(command);
                 else if (c == 127)
                     command = command.substr(0, command.length() - 1);
                 else
@@ -1186,6 +5467,174 @@ struct Cursor {
     }
 };
 
+/* An append-only log of the commands which changed a drawing, kept next to its file so that work can be recovered
+ * after a crash. The log starts with a checkpoint of the whole drawing, and is replaced by a new checkpoint once
+ * enough commands have been appended. Every record ends with a CRC, so a record cut short by a crash is ignored. */
+class OpLog {
+    private:
+        std::string filename;
+        int fd;
+        uint ops;
+        std::function<void(std::string)> report; // Called from the writer thread if a checkpoint fails
+
+        std::thread writer; // Writes the latest checkpoint, so the input thread doesn't wait for the disk
+        std::mutex lock;
+        bool writing;
+        std::vector<std::string> queued; // Ops run while the checkpoint is written, appended once it is in place
+
+        static std::string record(uchar type, const std::string& data) {
+            uint size = data.size();
+            uint crc = crc32(crc32(0, &type, 1), reinterpret_cast<const uchar*>(data.data()), data.size());
+            std::string out(1, type);
+            out.append(reinterpret_cast<char*>(&size), sizeof(size));
+            out += data;
+            out.append(reinterpret_cast<char*>(&crc), sizeof(crc));
+            return out;
+        }
+
+    public:
+        static const uchar CHECKPOINT = 1;
+        static const uchar OP = 2;
+        static const uint CHECKPOINT_INTERVAL = 1000;
+
+        struct Record {
+            uchar type;
+            std::string data;
+        };
+
+        static void write_all(int fd, const std::string& out, const std::string& filename) {
+            size_t done = 0;
+            while (done < out.size()) {
+                ssize_t n = ::write(fd, out.data() + done, out.size() - done);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) throw std::invalid_argument(std::format("Can't write to {}: {}", filename, std::strerror(errno)).c_str());
+                done += n;
+            }
+        }
+
+        /* Waits for the checkpoint being written, if any. */
+        void wait() {
+            if (writer.joinable()) writer.join();
+        }
+
+        /* Nothing is logged if filename is empty (in replays). */
+        OpLog(std::string filename, std::function<void(std::string)> report) :
+            filename{filename}, fd{-1}, ops{0}, report{report}, writing{false} {}
+
+        ~OpLog() {
+            wait();
+            if (fd >= 0) close(fd);
+        }
+
+        std::string get_filename() { return filename; }
+
+        bool needs_checkpoint() { return ops >= CHECKPOINT_INTERVAL; }
+
+        /* Reads the records in a log up to the first incomplete or corrupt one. */
+        static std::vector<Record> read(std::string filename) {
+            std::vector<Record> records;
+            std::ifstream input_file(filename, std::ios::binary | std::ios::in);
+
+            while (input_file) {
+                Record r;
+                uint size, crc;
+                if (!input_file.read(reinterpret_cast<char*>(&r.type), 1)) break;
+                if (!input_file.read(reinterpret_cast<char*>(&size), sizeof(size))) break;
+                r.data.resize(size);
+                if (!input_file.read(r.data.data(), size)) break;
+                if (!input_file.read(reinterpret_cast<char*>(&crc), sizeof(crc))) break;
+                if (crc != crc32(crc32(0, &r.type, 1), reinterpret_cast<const uchar*>(r.data.data()), size)) break;
+                records.push_back(std::move(r));
+            }
+
+            return records;
+        }
+
+        /* Replaces the log with a single checkpoint, written and synced on another thread. Until it is in place the
+         * old log stays on disk, and a crash loses the commands since then. */
+        void checkpoint(std::string state) {
+            if (filename == "") return;
+            wait();
+            if (fd >= 0) close(fd);
+            fd = -1;
+            ops = 0;
+            writing = true;
+
+            writer = std::thread([this, state = std::move(state)]() {
+                std::string error;
+                int out = -1;
+                try {
+                    write_atomically(filename, [&](std::ostream& output) { output << record(CHECKPOINT, state); });
+                    out = open(filename.c_str(), O_WRONLY | O_APPEND);
+                    if (out < 0) error = std::format("Can't open {}: {}", filename, std::strerror(errno));
+                } catch (std::invalid_argument& e) {
+                    error = e.what();
+                }
+
+                std::lock_guard<std::mutex> guard(lock);
+                try {
+                    if (out >= 0) for (const std::string& op : queued) write_all(out, op, filename);
+                } catch (std::invalid_argument& e) {
+                    error = e.what();
+                }
+                fd = out;
+                queued.clear();
+                writing = false;
+                if (error != "") report(error);
+            });
+        }
+
+        /* Appends a command. It only has to reach the kernel to survive a crash of the editor, so it isn't synced. */
+        void append(const std::string& op) {
+            std::string out = record(OP, op);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (writing) {
+                    queued.push_back(out);
+                    ops++;
+                    return;
+                }
+            }
+            if (fd < 0) return;
+            write_all(fd, out, filename);
+            ops++;
+        }
+
+        /* Deletes the log once the editor exits cleanly. */
+        void remove() {
+            wait();
+            if (fd >= 0) close(fd);
+            fd = -1;
+            if (filename != "") unlink(filename.c_str());
+        }
+};
+
+struct Layout {
+    uint canvas_width;
+    uint canvas_height;
+    int rows;
+    int cols;
+    Point<uint> term_pos;
+    uint term_width;
+    uint term_height;
+    Point<uint> out_pos;
+    uint out_width;
+    uint out_height;
+
+    Layout(uint canvas_width, uint canvas_height, int rows, int cols) :
+        canvas_width{canvas_width}, canvas_height{canvas_height}, rows{rows}, cols{cols},
+        term_pos(Canvas::screen_cols(canvas_width) + 2, 0),
+        term_width{cols > (int)Canvas::screen_cols(canvas_width) + 2 ? cols - Canvas::screen_cols(canvas_width) - 2 : 0},
+        term_height{Canvas::screen_rows(canvas_height) / 2},
+        out_pos(Canvas::screen_cols(canvas_width) + 2, term_height), out_width{term_width},
+        out_height{Canvas::screen_rows(canvas_height) - term_height}
+        {}
+
+    bool same_canvas(const Layout& l) const { return canvas_width == l.canvas_width && canvas_height == l.canvas_height; }
+    bool same_term(Layout l) const { return l.term_pos == term_pos && term_width == l.term_width && term_height == l.term_height; }
+    bool same_out(Layout l) const { return l.out_pos == out_pos && out_width == l.out_width && out_height == l.out_height; }
+};
+
 enum Action { ACT_NONE, ACT_DRAW_LINE, ACT_DRAW_CIRCLE, ACT_DRAW_BOUNDARY, ACT_DRAW_ELLIPSE, ACT_FILL_CIRCLE, ACT_FILL_ELLIPSE, ACT_FILL_AREA, ACT_GET_MOVE_AREA, ACT_GET_MOVE_DEST };
 
 class Drawer {
@@ -1209,8 +5658,264 @@ class Drawer {
             else std::cout << "\033[?25l" << std::flush;
         }
 
-        static void sigint_handler(int signum) {
-            d->out.draw("Input the \"quit\" command to quit");
+        static volatile sig_atomic_t interrupted;
+
+        static void sigint_handler(int signum) {
+            interrupted = 1;
+        }
+
+        static volatile sig_atomic_t resized;
+
+        static void sigwinch_handler(int signum) {
+            resized = 1;
+        }
+
+        Layout get_layout() {
+            return Layout(canvas.get_width(), canvas.get_height(), rows, cols);
+        }
+
+        void query_size() {
+            if (Session::replaying()) {
+                Session::get_size(rows, cols);
+                return;
+            }
+            struct winsize w;
+            ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+            rows = w.ws_row;
+            cols = w.ws_col;
+            Session::size_changed(rows, cols);
+        }
+
+        static std::string erase_rect(uint x, uint y, uint width, uint height) {
+            std::string out;
+            if (width == 0) return out;
+            std::string line(width, ' ');
+            for (uint i = y; i < y + height; i++) out += std::format("\033[{};{}H{}", i + 1, x + 1, line);
+            return out;
+        }
+
+        /* Recomputes the geometry of the panes and only redraws the ones that moved. Areas which are no longer
+         * covered are erased instead of clearing the whole screen. */
+        void relayout() {
+            Layout l = get_layout();
+            std::string erase = "\033[0m";
+            bool term_changed = !layout.same_term(l);
+            bool out_changed = !layout.same_out(l);
+
+            if (!layout.same_canvas(l)) {
+                uint old_width = Canvas::screen_cols(layout.canvas_width);
+                uint new_width = Canvas::screen_cols(l.canvas_width);
+                uint old_height = Canvas::screen_rows(layout.canvas_height);
+                uint new_height = Canvas::screen_rows(l.canvas_height);
+                if (old_width > new_width)
+                    erase += erase_rect(new_width, 0, old_width - new_width, std::min(old_height, new_height));
+                if (old_height > new_height)
+                    erase += erase_rect(0, new_height, old_width, old_height - new_height);
+                erase += erase_rect(0, old_height + 1, layout.cols, 3);
+
+                cursor = Cursor(Point<int>(std::min(cursor.pos.x, (int)l.canvas_width - 1), std::min(cursor.pos.y, (int)l.canvas_height - 1)), cursor.type, l.canvas_width, l.canvas_height);
+            }
+            if (term_changed) erase += erase_rect(layout.term_pos.x, layout.term_pos.y, layout.term_width, layout.term_height);
+            if (out_changed) erase += erase_rect(layout.out_pos.x, layout.out_pos.y, layout.out_width, layout.out_height);
+            Screen::write(erase);
+
+            layout = l;
+            term.set_geometry(l.term_pos, l.term_width, l.term_height);
+            out.set_geometry(l.out_pos, l.out_width, l.out_height);
+            if (out_changed) out.draw();
+            if (term_changed) term.draw();
+        }
+
+        void handle_resize() {
+            resized = 0;
+            query_size();
+            relayout();
+            draw();
+        }
+
+        std::vector<Canvas::Snapshot> frames; // The current frame is only stored here when switching frames
+        std::vector<uint> delays;
+        uint curr_frame;
+        bool onion;
+
+        void store_frame() {
+            frames[curr_frame] = canvas.snapshot();
+        }
+
+        OpLog log;
+
+        /* Captures everything needed to continue editing: the frames, their delays and the current frame. */
+        std::string checkpoint_state() {
+            store_frame();
+            std::ostringstream output;
+            uint count = frames.size();
+            output.write(reinterpret_cast<char*>(&curr_frame), sizeof(curr_frame));
+            output.write(reinterpret_cast<char*>(&count), sizeof(count));
+            for (uint i = 0; i < count; i++) {
+                output.write(reinterpret_cast<char*>(&delays[i]), sizeof(delays[i]));
+                Canvas::write(output, frames[i]);
+            }
+            return std::move(output).str();
+        }
+
+        void restore_state(const std::string& state) {
+            std::istringstream input(state);
+            input.exceptions(std::istream::failbit | std::istream::badbit);
+            uint frame, count;
+            input.read(reinterpret_cast<char*>(&frame), sizeof(frame));
+            input.read(reinterpret_cast<char*>(&count), sizeof(count));
+            if (count == 0 || frame >= count) throw std::invalid_argument("Invalid checkpoint");
+
+            frames.clear();
+            delays.resize(count);
+            for (uint i = 0; i < count; i++) {
+                input.read(reinterpret_cast<char*>(&delays[i]), sizeof(delays[i]));
+                frames.push_back(Canvas(input).snapshot());
+            }
+            curr_frame = frame;
+            canvas.restore(frames[curr_frame]);
+            relayout();
+        }
+
+        /* Ops record the cursor and color they were run with, since most commands depend on them. */
+        static std::string op_record(Point<int> pos, const Pixel& color, const std::string& line) {
+            std::ostringstream output;
+            output.write(reinterpret_cast<char*>(&pos.x), sizeof(pos.x));
+            output.write(reinterpret_cast<char*>(&pos.y), sizeof(pos.y));
+            color.write(output);
+            output << line;
+            return std::move(output).str();
+        }
+
+        void replay_op(const std::string& op) {
+            std::istringstream input(op);
+            input.exceptions(std::istream::failbit | std::istream::badbit);
+            Point<int> pos(0,0);
+            input.read(reinterpret_cast<char*>(&pos.x), sizeof(pos.x));
+            input.read(reinterpret_cast<char*>(&pos.y), sizeof(pos.y));
+            curr_pixel = Pixel::read(input);
+            std::string line = op.substr(input.tellg());
+
+            cursor = Cursor(pos, cursor.type, canvas.get_width(), canvas.get_height());
+            Command* command = Terminal::parse(line);
+            if (command == NULL) return;
+            try {
+                command->execute(*this);
+                if (task != NULL) run_task(true);
+            } catch (std::exception& e) {}
+            delete command;
+        }
+
+        void checkpoint() {
+            log.checkpoint(checkpoint_state());
+            canvas.history_logged();
+        }
+
+        /* Replays the log left behind if the editor didn't exit cleanly, and starts a new one. */
+        void recover() {
+            std::vector<OpLog::Record> records = OpLog::read(log.get_filename());
+            uint start = records.size();
+            for (uint i = 0; i < records.size(); i++) if (records[i].type == OpLog::CHECKPOINT) start = i;
+
+            uint replayed = 0;
+            if (start < records.size()) {
+                try {
+                    restore_state(records[start].data);
+                    for (uint i = start + 1; i < records.size(); i++, replayed++) replay_op(records[i].data);
+                } catch (std::exception& e) {
+                    out.draw(std::format("Failed to recover from {}: {}", log.get_filename(), e.what()));
+                }
+            }
+
+            checkpoint();
+            if (start < records.size()) out.draw(std::format("Recovered {} commands from {}", replayed, log.get_filename()));
+        }
+
+        /* Runs a command and logs it if it changed the drawing. Commands which started a task are logged once it
+         * finishes. */
+        void execute(Command* command) {
+            if (command == NULL) return;
+            Point<int> pos = cursor.pos;
+            Pixel color = curr_pixel;
+            command->execute(*this);
+
+            if (task != NULL) {
+                task_command = command;
+                task_pos = pos;
+                task_color = color;
+                return;
+            }
+            log_command(command, pos, color);
+            delete command;
+        }
+
+        void log_command(Command* command, Point<int> pos, const Pixel& color) {
+            try {
+                LogMode mode = command->log_mode();
+                if (mode == LOG_APPEND) log.append(op_record(pos, color, command->line));
+                if (mode == LOG_CHECKPOINT || log.needs_checkpoint()) checkpoint();
+            } catch (std::invalid_argument& e) {
+                out.draw(std::format("Failed to log: {}", e.what()));
+            }
+        }
+
+        void execute(std::string line) {
+            execute(Terminal::parse(line));
+        }
+
+        /* Leaves the terminal usable and lets the default action end the process. The log is already on disk. */
+        static std::string crash_message; // Written by the handler, so it is formatted beforehand
+
+        static void sigsegv_handler(int signum) {
+            tcgetattr(STDIN_FILENO, &attributes);
+            attributes.c_lflag |= ECHO | ICANON;
+            tcsetattr(STDIN_FILENO, TCSANOW, &attributes);
+            ssize_t ignored = ::write(STDOUT_FILENO, crash_message.data(), crash_message.size());
+            (void)ignored;
+            std::signal(signum, SIG_DFL);
+            std::raise(signum);
+        }
+
+        struct SaveTask {
+            std::thread thread;
+            std::atomic<bool> done;
+        };
+
+        std::list<SaveTask> saves;
+        std::mutex messages_lock;
+        std::vector<std::string> messages; // From saves, shown by the main loop
+        int wake[2];                       // Written to when there are new messages
+
+        void post(std::string message) {
+            {
+                std::lock_guard<std::mutex> lock(messages_lock);
+                messages.push_back(message);
+            }
+            char c = 0;
+            ssize_t ignored = ::write(wake[1], &c, 1);
+            (void)ignored;
+        }
+
+        std::function<void(std::string)> log_failed() {
+            return [this](std::string error) { post(std::format("Not logging changes: {}", error)); };
+        }
+
+        /* Shows the messages from finished saves and joins their threads. */
+        std::vector<std::string> collect_messages() {
+            char buf[64];
+            while (read(wake[0], buf, sizeof(buf)) > 0);
+
+            for (auto it = saves.begin(); it != saves.end();) {
+                if (!it->done) {
+                    it++;
+                    continue;
+                }
+                it->thread.join();
+                it = saves.erase(it);
+            }
+
+            std::lock_guard<std::mutex> lock(messages_lock);
+            return std::move(messages);
         }
 
     public:
@@ -1218,74 +5923,137 @@ class Drawer {
         Cursor cursor;
         Pixel curr_pixel;
         OutputTerminal out;
+        Layout layout;
         int rows;
         int cols;
 
-        Drawer(uint width, uint height) :
+        /* New drawings log to a file of their own, so a log left behind by another one is never replayed into them.
+         * Recovering one of those logs is asked for by passing it as log_filename. */
+        Drawer(uint width, uint height, std::string log_filename = "") :
             canvas(width, height),
             cursor(Point<int>(0,0), BASIC, width, height),
-            term(Point<uint>(2 * width + 2, 0),  20, 20, Pixel::black, Pixel::green),
-            out(Point<uint>(2 * width + 2, 25), 20, 20, Pixel::black, Pixel::green), run{true}
+            term(Point<uint>(0,0), 0, 0, Pixel::black, Pixel::green),
+            out(Point<uint>(0,0), 0, 0, Pixel::white, Pixel::black),
+            layout(0,0,0,0), run{true}, frames(1), delays{100}, curr_frame{0}, onion{false}, log(Session::replaying() ? "" : log_filename != "" ? log_filename : std::format("untitled-{}.tart.log", getpid()), log_failed())
         {
-            struct winsize w;
-            ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-            rows = w.ws_row;
-            cols = w.ws_col;
-
-            term = Terminal(Point<uint>(2 * width + 2, 0), cols - 2 * width - 2, height / 2, Pixel::black, Pixel::green);
-            out = OutputTerminal(Point<uint>(2 * width + 2, height / 2), cols - 2 * width - 2, height - height / 2, Pixel::white, Pixel::black);
-            cursor = Cursor(Point<int>(0,0), BASIC, width, height);
+            query_size();
+            layout = get_layout();
+            term.set_geometry(layout.term_pos, layout.term_width, layout.term_height);
+            out.set_geometry(layout.out_pos, layout.out_width, layout.out_height);
         }
 
         Drawer(std::string filename) :
             canvas(filename),
             cursor(Point<int>(0,0), BASIC, canvas.get_width(), canvas.get_height()),
-            out(Point<uint>(2 * canvas.get_width() + 2, 25), 20, 20, Pixel::black, Pixel::green),
-            term(Point<uint>(2 * canvas.get_width() + 2, 0), 20, 20, Pixel::black, Pixel::green),
-            run{true}
+            term(Point<uint>(0,0), 0, 0, Pixel::black, Pixel::green),
+            out(Point<uint>(0,0), 0, 0, Pixel::white, Pixel::black),
+            layout(0,0,0,0), run{true}, frames(1), delays{100}, curr_frame{0}, onion{false}, log(Session::replaying() ? "" : filename + ".log", log_failed())
         {
-            struct winsize w;
-            ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-            rows = w.ws_row;
-            cols = w.ws_col;
-
-            uint width = canvas.get_width();
-            uint height = canvas.get_height();
-
-            term = Terminal(Point<uint>(2 * width + 2, 0), cols - 2 * width - 2, height / 2, Pixel::black, Pixel::green);
-            out = OutputTerminal(Point<uint>(2 * width + 2, height / 2), cols - 2 * width - 2, height - height / 2, Pixel::white, Pixel::black);
-            cursor = Cursor(Point<int>(0,0), BASIC, width, height);
+            query_size();
+            layout = get_layout();
+            term.set_geometry(layout.term_pos, layout.term_width, layout.term_height);
+            out.set_geometry(layout.out_pos, layout.out_width, layout.out_height);
+
+            if (Animation::is_animation(filename)) {
+                Animation anim(filename);
+                frames = anim.to_snapshots();
+                delays = anim.delays();
+            }
         }
 
         void resize(uint width, uint height) {
             canvas.resize(width, height);
-            term = Terminal(Point<uint>(2 * width + 2, 0), cols - 2 * width - 2, height / 2, Pixel::black, Pixel::green);
-            out = OutputTerminal(Point<uint>(2 * width + 2, height / 2), cols - 2 * width - 2, height - height / 2, Pixel::white, Pixel::black);
-            cursor = Cursor(Point<int>(0,0), BASIC, width, height);
-            draw_all();
+            relayout();
         }
 
-        void draw_all() {
-            std::cout << "\033[2J\033[H" << std::flush;
-            draw();
-            out.draw();
-            term.draw();
+        bool trim() {
+            if (!canvas.trim(4)) return false;
+            relayout();
+            return true;
         }
 
         void draw() {
-            canvas.draw();
+            canvas.draw(onion && curr_frame > 0 ? &frames[curr_frame - 1] : NULL);
             std::string line(cols, ' ');
-            std::print("{}\033[{};1H{}\033[{};1H{}\033[{};1H{}", curr_pixel.bg(), canvas.get_height() + 2, line, canvas.get_height() + 3, line, canvas.get_height() + 4, line);
+            uint bar = Canvas::screen_rows(canvas.get_height()) + 2;
+            Screen::write(std::format("{}\033[{};1H{}\033[{};1H{}\033[{};1H{}", curr_pixel.bg(), bar, line, bar + 1, line, bar + 2, line), Screen::STATUS);
         }
 
         void blur(uint x_reduction, uint y_reduction) {
-            canvas.blur(x_reduction, y_reduction);
-            uint width = canvas.get_width();
-            uint height = canvas.get_height();
-            term = Terminal(Point<uint>(2 * width + 2, 0), cols - 2 * width - 2, height / 2, Pixel::black, Pixel::green);
-            out = OutputTerminal(Point<uint>(2 * width + 2, height / 2), cols - 2 * width - 2, height - height / 2, Pixel::white, Pixel::black);
-            cursor = Cursor(Point<int>(0,0), BASIC, width, height);
-            draw_all();
+            start(canvas.blur_task(x_reduction, y_reduction), "Blurring", [this]() { relayout(); });
+        }
+
+        /* A long operation which is running. The main loop runs it a slice at a time, only reading keys to see if
+         * Esc cancels it, and the command which started it is logged once it finishes. */
+        Task* task = NULL;
+        std::string task_name;
+        std::function<void()> task_done;
+        int task_percent;
+        Command* task_command = NULL;
+        Point<int> task_pos = Point<int>(0, 0);
+        Pixel task_color;
+        static constexpr uint TASK_SLICE = 20; // Milliseconds between frames while a task runs
+
+        /* Starts a task, with done called if it finishes. Tasks which finish in their first slice don't show
+         * their progress. */
+        void start(Task* t, std::string name, std::function<void()> done = NULL) {
+            task = t;
+            task_name = name;
+            task_done = done;
+            task_percent = -1;
+            run_task();
+        }
+
+        /* Runs the task for a slice of time, or to the end if all is set. */
+        void run_task(bool all = false) {
+            auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(TASK_SLICE);
+            uint stop = Session::stop_chunk();
+            bool finished = false;
+            while (task->get_done() < stop && !(finished = task->step()) && (all || Session::replaying() || std::chrono::steady_clock::now() < end));
+
+            if (!finished) {
+                int percent = task->progress() * 100;
+                if (percent != task_percent) out.draw(std::format("{}... {}% (Esc to cancel)", task_name, percent));
+                task_percent = percent;
+                return;
+            }
+
+            delete task;
+            task = NULL;
+            if (task_percent >= 0) out.draw(std::format("{}... done", task_name));
+            if (task_done) task_done();
+            if (task_command != NULL) {
+                log_command(task_command, task_pos, task_color);
+                delete task_command;
+                task_command = NULL;
+            }
+        }
+
+        /* Reads the rest of an escape sequence (e.g. an arrow key) typed during a task, so it is dropped rather than
+         * read as keys later. Returns false if the Esc came on its own, which cancels the task. */
+        bool skip_escape_sequence() {
+            static const int ESCAPE_TIMEOUT = 50; // Milliseconds, more than terminals take to send a whole sequence
+            uint chunk = task->get_done();
+            char c;
+            if (!Session::read_during(chunk, c, ESCAPE_TIMEOUT)) return false;
+            if (c == '[') while (Session::read_during(chunk, c, ESCAPE_TIMEOUT) && !(c >= 0x40 && c <= 0x7E));
+            else if (c == 'O') Session::read_during(chunk, c, ESCAPE_TIMEOUT);
+            return true;
+        }
+
+        /* Rolls back what the task has done so far. Its command is never logged. */
+        void cancel_task() {
+            task->cancel();
+            delete task;
+            task = NULL;
+            delete task_command;
+            task_command = NULL;
+            out.draw(std::format("{} cancelled", task_name));
+        }
+
+        void scale(uint width, uint height, ScaleMode mode) {
+            canvas.scale(width, height, mode);
+            relayout();
         }
 
         void quit() {
@@ -1293,24 +6061,95 @@ class Drawer {
             run = false;
         }
 
-        void undo(int times = 1) {
-            canvas.undo(times);
-            uint width = canvas.get_width();
-            uint height = canvas.get_height();
-            term = Terminal(Point<uint>(2 * width + 2, 0), cols - 2 * width - 2, height / 2, Pixel::black, Pixel::green);
-            out = OutputTerminal(Point<uint>(2 * width + 2, height / 2), cols - 2 * width - 2, height - height / 2, Pixel::white, Pixel::black);
-            cursor = Cursor(Point<int>(0,0), BASIC, width, height);
-            draw_all();
+        uint get_frame() { return curr_frame; }
+        uint frame_count() { return frames.size(); }
+        uint get_delay() { return delays[curr_frame]; }
+        void set_delay(uint delay) { delays[curr_frame] = delay; }
+
+        /* Adds a copy of the current frame after it and switches to the copy. */
+        void add_frame() {
+            store_frame();
+            frames.insert(frames.begin() + curr_frame + 1, frames[curr_frame]);
+            delays.insert(delays.begin() + curr_frame + 1, delays[curr_frame]);
+            curr_frame++;
+            canvas.restore(frames[curr_frame]);
+        }
+
+        void goto_frame(uint frame) {
+            if (frame >= frames.size() || frame == curr_frame) return;
+            store_frame();
+            curr_frame = frame;
+            canvas.restore(frames[curr_frame]);
+            relayout();
+        }
+
+        void delete_frame() {
+            if (frames.size() == 1) return;
+            frames.erase(frames.begin() + curr_frame);
+            delays.erase(delays.begin() + curr_frame);
+            if (curr_frame == frames.size()) curr_frame--;
+            canvas.restore(frames[curr_frame]);
+            relayout();
+        }
+
+        void set_onion(bool on) {
+            onion = on;
+            canvas.update_all();
+        }
+
+        /* Saves a copy of the frames on another thread, so editing can continue. The result is shown in the output
+         * pane once the file is on disk. */
+        void save(std::string filename) {
+            store_frame();
+            SaveTask& task = saves.emplace_back();
+            task.done = false;
+            task.thread = std::thread([this, &task, filename, frames = frames, delays = delays]() {
+                try {
+                    if (frames.size() == 1) frames[0].save(filename);
+                    else Animation(frames, delays).save(filename);
+                    post(std::format("Saved to {}!", filename));
+                } catch (std::exception& e) {
+                    post(std::format("Failed to save {}: {}", filename, e.what()));
+                }
+                task.done = true;
+            });
+        }
+
+        bool undo(int times = 1) {
+            bool replayable = canvas.undo(times);
+            relayout();
+            return replayable;
+        }
+
+        /* A checksum of the frames and their delays, to compare the results of replays. */
+        uint hash() {
+            std::string state = checkpoint_state();
+            return crc32(0, reinterpret_cast<const uchar*>(state.data()), state.size());
         }
 
         void main() {
             Drawer::d = this;
-            std::signal(SIGSEGV, Drawer::sigint_handler);
-            std::signal(SIGINT, Drawer::sigint_handler);
+            if (log.get_filename().starts_with("untitled-"))
+                crash_message = std::format("\033[0m\033[?25h\033[2J\033[HTermiArt crashed. Your work can be recovered with --recover {}\n", log.get_filename());
+            else crash_message = "\033[0m\033[?25h\033[2J\033[HTermiArt crashed. Your work will be recovered from its log when the file is opened again.\n";
+            std::signal(SIGSEGV, Drawer::sigsegv_handler);
+
+            // No SA_RESTART, so a blocked read returns to the loop
+            struct sigaction winch = {};
+            winch.sa_handler = Drawer::sigwinch_handler;
+            sigemptyset(&winch.sa_mask);
+            sigaction(SIGWINCH, &winch, NULL);
+            struct sigaction intr = winch;
+            intr.sa_handler = Drawer::sigint_handler;
+            sigaction(SIGINT, &intr, NULL);
+
+            if (pipe(wake) != 0) throw std::runtime_error("Can't create pipe");
+            fcntl(wake[0], F_SETFL, O_NONBLOCK);
 
             change_echo(false);
             show_cursor(false);
             std::cout << "\033[2J\033[H" << std::flush;
+            if (!Session::replaying()) Screen::start(); // Replays write on this thread, so what they count doesn't depend on timing
 
             char c;
             Action act = ACT_NONE;
@@ -1321,6 +6160,9 @@ class Drawer {
 
             out.draw("");
             term.draw();
+            if (Session::replaying()) restore_state(Session::get_state());
+            else recover();
+            Session::begin(checkpoint_state());
 
             while (run) {
                 switch (act) {
@@ -1341,24 +6183,65 @@ class Drawer {
                 const Pixel& on_color = canvas[cursor.pos.x, cursor.pos.y];
                 Pixel cursor_color = Pixel::black;
                 if (on_color.r + on_color.g + on_color.b < 383) cursor_color = Pixel::white;
-                std::print("\033[{};{}H{}{}{}\033[0m", cursor.pos.y + 1, 2 * cursor.pos.x + 1, on_color.bg(), cursor_color.fg(), cursor.to_string());
+                if (Canvas::half_blocks) { // Show the cursor's half of the cell in a contrasting color
+                    uint top = cursor.pos.y & ~1;
+                    const Pixel* bottom = top + 1 < canvas.get_height() ? &canvas[cursor.pos.x, top + 1] : NULL;
+                    std::string cell;
+                    CellEncoder e(cell);
+                    if (cursor.pos.y % 2) Pixel::encode_half(e, canvas[cursor.pos.x, top], &cursor_color, true, cursor.pos.x, top);
+                    else Pixel::encode_half(e, cursor_color, bottom, true, cursor.pos.x, top);
+                    Screen::write(std::format("\033[{};{}H{}\033[0m", top / 2 + 1, cursor.pos.x + 1, cell), Screen::CURSOR);
+                } else Screen::write(std::format("\033[{};{}H{}{}{}\033[0m", cursor.pos.y + 1, 2 * cursor.pos.x + 1, on_color.bg(), cursor_color.fg(), cursor.to_string()), Screen::CURSOR);
+
+                Screen::present();
+
+                if (task != NULL) { // Other keys wait until the task is done
+                    while (task != NULL && Session::read_during(task->get_done(), c)) {
+                        if (c != 27) typeahead.push_back(c);
+                        else if (!skip_escape_sequence()) cancel_task();
+                    }
+                    if (task != NULL) run_task();
+                    if (resized) handle_resize();
+                    continue;
+                }
+
+                // If the terminal is behind, the frame is handed over again after a short wait
+                struct pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {wake[0], POLLIN, 0}};
+                if (typeahead.empty() && !Session::replaying() && !resized && !interrupted && poll(fds, 2, Screen::pending() ? 10 : -1) >= 0) {
+                    if (fds[1].revents & POLLIN)
+                        for (const std::string& message : collect_messages()) out.draw(message);
+                    if (!(fds[0].revents & (POLLIN | POLLHUP))) continue;
+                }
 
-                std::cin.get(c);
+                int n = (resized || interrupted) ? -1 : read_key(c);
+                if (n < 0) {
+                    if (resized) handle_resize();
+                    if (interrupted) {
+                        interrupted = 0;
+                        out.draw("Input the \"quit\" command to quit");
+                    }
+                    continue;
+                } else if (n == 0) break;
 
                 switch (c) {
                     case 27: act = ACT_NONE; break;
                     case ' ': {
+                        // Actions are run as commands, so they are logged like the ones from the terminal
+                        Point<uint> p = cursor.get_pos();
+                        long r = std::roundl(prev_point.distance(p));
+                        int rx = (int)p.x - (int)prev_point.x;
+                        int ry = (int)p.y - (int)prev_point.y;
                         switch (act) {
-                            case ACT_NONE: canvas.point(curr_pixel, cursor.get_pos()); break;
-                            case ACT_DRAW_LINE: canvas.draw_line(prev_point, cursor.get_pos(), curr_pixel); break;
-                            case ACT_DRAW_CIRCLE: canvas.draw_circle(prev_point, std::roundl(prev_point.distance(cursor.get_pos())), curr_pixel); break;
-                            case ACT_DRAW_BOUNDARY: canvas.draw_boundary_line(prev_point, cursor.get_pos()); break;
-                            case ACT_DRAW_ELLIPSE: canvas.draw_ellipse(prev_point, cursor.get_pos().x - prev_point.x, cursor.get_pos().y - prev_point.y, curr_pixel); break;
-                            case ACT_FILL_CIRCLE: canvas.fill_circle(prev_point, std::roundl(prev_point.distance(cursor.get_pos())), curr_pixel); break;
-                            case ACT_FILL_ELLIPSE: canvas.fill_ellipse(prev_point, cursor.get_pos().x - prev_point.x, cursor.get_pos().y - prev_point.y, curr_pixel); break;
-                            case ACT_FILL_AREA: canvas.fill_area(prev_point, cursor.get_pos(), curr_pixel); break;
-                            case ACT_GET_MOVE_AREA: pprev_point = cursor.get_pos(); break;
-                            case ACT_GET_MOVE_DEST: canvas.move(prev_point, pprev_point, cursor.get_pos()); break;
+                            case ACT_NONE: execute(std::format("draw point {} {}", p.x, p.y)); break;
+                            case ACT_DRAW_LINE: execute(std::format("draw line {} {} {} {}", prev_point.x, prev_point.y, p.x, p.y)); break;
+                            case ACT_DRAW_CIRCLE: execute(std::format("draw circle {} {} {}", prev_point.x, prev_point.y, r)); break;
+                            case ACT_DRAW_BOUNDARY: execute(std::format("draw boundary {} {} {} {}", prev_point.x, prev_point.y, p.x, p.y)); break;
+                            case ACT_DRAW_ELLIPSE: execute(std::format("draw ellipse {} {} {} {}", prev_point.x, prev_point.y, rx, ry)); break;
+                            case ACT_FILL_CIRCLE: execute(std::format("fill circle {} {} {}", prev_point.x, prev_point.y, r)); break;
+                            case ACT_FILL_ELLIPSE: execute(std::format("fill ellipse {} {} {} {}", prev_point.x, prev_point.y, rx, ry)); break;
+                            case ACT_FILL_AREA: execute(std::format("fill area {} {} {} {}", prev_point.x, prev_point.y, p.x, p.y)); break;
+                            case ACT_GET_MOVE_AREA: pprev_point = p; break;
+                            case ACT_GET_MOVE_DEST: execute(std::format("move {} {} {} {} {} {}", prev_point.x, prev_point.y, pprev_point.x, pprev_point.y, p.x, p.y)); break;
                         }
                         if (act == ACT_GET_MOVE_AREA) act = ACT_GET_MOVE_DEST;
                         else act = ACT_NONE;
@@ -1371,10 +6254,7 @@ class Drawer {
                     case '/': {
                         term.clear();
                         try {
-                            Command* command = term.main();
-                            if (command == NULL) break;
-                            command->execute(*this);
-                            delete command;
+                            execute(term.main([this]() { if (resized) handle_resize(); }));
                         } catch (std::invalid_argument e) {}
                         break;
                     }
@@ -1418,40 +6298,41 @@ class Drawer {
                         act = ACT_GET_MOVE_AREA;
                         break;
                     }
-                    case 'f': canvas.fill_area(cursor.get_pos(), curr_pixel); break;
+                    case 'f': execute(std::format("fill flood {} {}", cursor.pos.x, cursor.pos.y)); break;
                     case '0': canvas.update_line(cursor.pos.y); cursor.pos.x = 0; break;
                     case '$': canvas.update_line(cursor.pos.y); cursor.pos.x = canvas.get_width() - 1; break;
                     case 'g': canvas.update_line(cursor.pos.y); cursor.pos.y = 0; break;
                     case 'G': canvas.update_line(cursor.pos.y); cursor.pos.y = canvas.get_height() - 1; break;
-                    default: std::print("\033[0m\033[40;1H{}", (int)c);
+                    default: Screen::write(std::format("\033[0m\033[40;1H{}", (int)c));
                 }
             }
 
+            Canvas::renderer->finish();
+            Screen::stop();
             show_cursor(true);
             change_echo(true);
+
+            log.remove();
+            for (SaveTask& task : saves) task.thread.join();
+            saves.clear();
+            for (const std::string& message : collect_messages()) std::print("{}\n", message);
+            close(wake[0]);
+            close(wake[1]);
         }
 };
 
 struct termios Drawer::attributes;
+std::string Drawer::crash_message;
 Drawer* Drawer::d;
+volatile sig_atomic_t Drawer::resized = 0;
+volatile sig_atomic_t Drawer::interrupted = 0;
 
 void QuitCommand::execute(Drawer& d) {
     d.quit();
 }
 
 void HelpCommand::execute(Drawer& d) {
-    std::string help_msg;
-    std::string line;
-    std::ifstream help_file;
-
-    help_file.open(fname);
-    while(!help_file.eof()) {
-        std::getline(help_file, line);
-        help_msg += line + '\n';
-    }
-    help_file.close();
-
-    d.out.draw(help_msg);
+    d.out.draw_static(text);
 }
 
 void ResizeCommand::execute(Drawer& d) {
@@ -1459,6 +6340,11 @@ void ResizeCommand::execute(Drawer& d) {
     d.resize(width, height);
 }
 
+void TrimCommand::execute(Drawer& d) {
+    if (d.trim()) d.out.draw(std::format("Trimmed to {}x{}", d.canvas.get_width(), d.canvas.get_height()));
+    else d.out.draw("Nothing to trim to");
+}
+
 void ScrollCommand::execute(Drawer& d) {
     d.out.move(dy);
 }
@@ -1498,7 +6384,7 @@ void OutputCommand::execute(Drawer& d) {
 }
 
 void UndoCommand::execute(Drawer& d) {
-    d.undo(times);
+    if (!d.undo(times)) mode = LOG_CHECKPOINT;
 }
 
 std::string OutputCommand::get_var(std::string varname, Drawer& d) {
@@ -1509,6 +6395,8 @@ std::string OutputCommand::get_var(std::string varname, Drawer& d) {
         return std::format("rgb({}, {}, {})", c.r, c.g, c.b);
     } else if (varname == "dimensions")
         return std::format("{}x{}", d.canvas.get_width(), d.canvas.get_height());
+    else if (varname == "frame")
+        return std::format("{}/{}", d.get_frame() + 1, d.frame_count());
     else if (varname == "version")
         return version_no;
     else if (varname == "credits")
@@ -1554,6 +6442,25 @@ void FillAreaCommand::execute(Drawer& d) {
     } catch (std::invalid_argument e) {}
 }
 
+void PointCommand::execute(Drawer& d) {
+    try {
+        d.canvas.point(d.curr_pixel, p);
+    } catch (std::invalid_argument e) {}
+}
+
+void DrawEllipseCommand::execute(Drawer& d) {
+    try {
+        if (fill) d.canvas.fill_ellipse(p, rx, ry, d.curr_pixel);
+        else d.canvas.draw_ellipse(p, rx, ry, d.curr_pixel);
+    } catch (std::invalid_argument e) {}
+}
+
+void FloodFillCommand::execute(Drawer& d) {
+    try {
+        d.start(d.canvas.fill_area_task(p, d.curr_pixel), "Filling");
+    } catch (std::invalid_argument e) {}
+}
+
 void FillBGCommand::execute(Drawer& d) {
     d.canvas.fill_bg(d.curr_pixel);
 }
@@ -1570,21 +6477,332 @@ void BlurCommand::execute(Drawer& d) {
 
 void InsertCommand::execute(Drawer& d) {
     try {
-        d.canvas.insert_art(filename, d.cursor.get_pos());
+        d.start(d.canvas.insert_art_task(filename, d.cursor.get_pos()), "Inserting");
     } catch (std::ifstream::failure e) {
         d.out.draw(std::format("Failed to read from file {}", filename));
     }
 }
 
 void SaveCommand::execute(Drawer& d) {
-    d.canvas.save(filename);
-    d.out.draw(std::format("Saved to {}!", filename));
+    d.save(filename);
+    d.out.draw(std::format("Saving to {}...", filename));
+}
+
+void ImportCommand::execute(Drawer& d) {
+    uint w = width ? width : d.canvas.get_width();
+    uint h = height ? height : d.canvas.get_height();
+
+    try {
+        std::unique_ptr<ImageReader> image = open_image(filename);
+        d.canvas.import_image(*image, d.cursor.get_pos(), w, h);
+        d.out.draw(std::format("Imported {} ({}x{}) as {}x{}", filename, image->get_width(), image->get_height(), w, h));
+    } catch (std::ifstream::failure e) {
+        d.out.draw(std::format("Failed to read from file {}", filename));
+    } catch (std::invalid_argument e) {
+        d.out.draw(std::format("Failed to import {}: {}", filename, e.what()));
+    }
+}
+
+void ImportAnsiCommand::execute(Drawer& d) {
+    try {
+        AnsiParser art = AnsiParser::parse_file(filename);
+        d.canvas.import_ansi(art, d.cursor.get_pos());
+        d.out.draw(std::format("Imported {} ({}x{} cells{})", filename, art.columns(), art.rows.size(),
+                    art.was_cut() ? std::format(", cut off at {}x{}", AnsiParser::MAX_COLUMNS, AnsiParser::MAX_ROWS) : ""));
+    } catch (std::invalid_argument e) {
+        d.out.draw(std::format("Failed to import {}: {}", filename, e.what()));
+    }
+}
+
+void ExportCommand::execute(Drawer& d) {
+    try {
+        d.canvas.export_file(filename, zoom, stored);
+        d.out.draw(std::format("Exported to {}!", filename));
+    } catch (std::ofstream::failure e) {
+        d.out.draw(std::format("Failed to write to file {}", filename));
+    } catch (std::invalid_argument e) {
+        d.out.draw(e.what());
+    }
+}
+
+void FrameCommand::execute(Drawer& d) {
+    switch (action) {
+        case FRAME_ADD: d.add_frame(); break;
+        case FRAME_DELETE: d.delete_frame(); break;
+        case FRAME_NEXT: d.goto_frame(d.get_frame() + 1); break;
+        case FRAME_PREV: if (d.get_frame() > 0) d.goto_frame(d.get_frame() - 1); break;
+        case FRAME_GOTO: d.goto_frame(arg); break;
+        case FRAME_DELAY: d.set_delay(arg); break;
+    }
+    d.out.draw(std::format("Frame {}/{} ({}ms)", d.get_frame() + 1, d.frame_count(), d.get_delay()));
+}
+
+void ScaleCommand::execute(Drawer& d) {
+    try {
+        d.scale(width, height, mode);
+    } catch (std::invalid_argument& e) {
+        d.out.draw(e.what());
+    }
+}
+
+void AdjustCommand::execute(Drawer& d) {
+    d.canvas.adjust(adjustment);
+}
+
+void SelectCommand::execute(Drawer& d) {
+    uint w = d.canvas.get_width();
+    uint h = d.canvas.get_height();
+    switch (shape) {
+        case SELECT_RECT: d.canvas.select(Selection::rect(w, h, Point<uint>(args[0], args[1]), Point<uint>(args[2], args[3])), op); break;
+        case SELECT_ELLIPSE: d.canvas.select(Selection::ellipse(w, h, Point<uint>(args[0], args[1]), std::abs(args[2]), std::abs(args[3])), op); break;
+        case SELECT_LASSO: {
+            std::vector<Point<int>> points;
+            for (uint i = 0; i < args.size(); i += 2) points.push_back(Point<int>(args[i], args[i + 1]));
+            d.canvas.select(Selection::polygon(w, h, points), op);
+            break;
+        }
+        case SELECT_WAND:
+            try {
+                d.canvas.select_wand(Point<uint>(args[0], args[1]), args.size() > 2 ? args[2] : 0, op);
+            } catch (std::invalid_argument& e) {
+                d.out.draw(e.what());
+                return;
+            }
+            break;
+        case SELECT_CLEAR: d.canvas.clear_selection(); break;
+    }
+
+    const Selection& s = d.canvas.get_selection();
+    if (s.is_everything()) d.out.draw("Nothing selected, commands apply to the whole canvas");
+    else d.out.draw(std::format("Selected {} pixels", s.count()));
+}
+
+void LayerCommand::execute(Drawer& d) {
+    switch (action) {
+        case LAYER_ADD: d.canvas.add_layer(name); break;
+        case LAYER_DELETE: d.canvas.delete_layer(); break;
+        case LAYER_SELECT:
+            try {
+                d.canvas.select_layer(arg);
+            } catch (std::invalid_argument& e) {
+                d.out.draw(e.what());
+                return;
+            }
+            break;
+        case LAYER_UP: d.canvas.move_layer(1); break;
+        case LAYER_DOWN: d.canvas.move_layer(-1); break;
+        case LAYER_SHOW: d.canvas.set_layer_visible(true); break;
+        case LAYER_HIDE: d.canvas.set_layer_visible(false); break;
+        case LAYER_OPACITY: d.canvas.set_layer_opacity(arg); break;
+        case LAYER_BLEND: d.canvas.set_layer_blend((BlendMode)arg); break;
+        case LAYER_RENAME: d.canvas.rename_layer(name); break;
+        case LAYER_LIST: {
+            std::string list;
+            for (uint k = d.canvas.layer_count(); k-- > 0;) list += d.canvas.describe_layer(k) + "\n";
+            d.out.draw(list);
+            return;
+        }
+    }
+    d.out.draw(d.canvas.describe_layer(d.canvas.get_layer()));
+}
+
+void OnionCommand::execute(Drawer& d) {
+    d.set_onion(on);
+}
+
+volatile sig_atomic_t viewing = 1; // Cleared when --follow or --watch is interrupted
+
+/* Shows the canvas of an editing session published under name, until the editor exits or this is interrupted. */
+void follow(std::string name) {
+    SharedCanvas shared(name, false);
+    Canvas canvas(1, 1);
+    std::vector<uint64_t> seen;
+    std::signal(SIGINT, [](int) { viewing = 0; });
+
+    std::cout << "\033[2J\033[H\033[?25l" << std::flush;
+    while (viewing) {
+        uint width = canvas.get_width(), height = canvas.get_height();
+        if (!shared.follow(canvas, seen)) break;
+        if (canvas.get_width() != width || canvas.get_height() != height) {
+            std::cout << "\033[2J";
+            Canvas::renderer->reset();
+        }
+        canvas.display();
+        std::cout << std::flush;
+        std::this_thread::sleep_for(std::chrono::milliseconds(16));
+    }
+    std::cout << std::format("\033[0m\033[{};1H\033[?25h", Canvas::screen_rows(canvas.get_height()) + 1);
+    std::print("{}\n", viewing ? "The session has ended" : "");
+}
+
+/* Shows filename, and then only what changes whenever it is written, until this is interrupted. */
+void watch(std::string filename) {
+    std::filesystem::path path = std::filesystem::absolute(filename);
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    // Files are usually replaced by renaming a new file over them, so the directory is watched rather than the file
+    if (fd < 0 || inotify_add_watch(fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        throw std::invalid_argument(std::format("Can't watch {}: {}", filename, std::strerror(errno)).c_str());
+
+    std::unique_ptr<Canvas> canvas = std::make_unique<Canvas>(filename);
+    std::signal(SIGINT, [](int) { viewing = 0; });
+    std::cout << "\033[2J\033[H\033[?25l";
+    canvas->display();
+    std::cout << std::flush;
+
+    alignas(inotify_event) char buf[4096];
+    while (viewing) {
+        struct pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, -1) < 0) continue;
+
+        bool changed = false;
+        ssize_t n;
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* e = buf; e < buf + n; e += sizeof(inotify_event) + reinterpret_cast<inotify_event*>(e)->len) {
+                inotify_event* event = reinterpret_cast<inotify_event*>(e);
+                if (event->len > 0 && path.filename() == event->name) changed = true;
+            }
+        }
+        if (!changed) continue;
+
+        std::unique_ptr<Canvas> next;
+        try {
+            next = std::make_unique<Canvas>(filename);
+        } catch (std::exception& e) { // Written in place and not finished yet, so the next write is waited for
+            continue;
+        }
+
+        if (next->get_width() != canvas->get_width() || next->get_height() != canvas->get_height()) {
+            std::cout << "\033[2J";
+            Canvas::renderer->reset();
+        }
+        next->display_changes(*canvas);
+        std::cout << std::flush;
+        canvas = std::move(next);
+    }
+
+    close(fd);
+    std::cout << std::format("\033[0m\033[{};1H\033[?25h", Canvas::screen_rows(canvas->get_height()) + 1) << std::flush;
+}
+
+/* Expands globs which the shell didn't (e.g. because they were quoted), and directories to the pixel arts in them. */
+std::vector<std::string> expand_files(const std::vector<std::string>& patterns) {
+    std::vector<std::string> files;
+
+    for (const std::string& pattern : patterns) {
+        if (std::filesystem::is_directory(pattern)) {
+            std::vector<std::string> found;
+            for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(pattern))
+                if (entry.path().extension() == ".tart") found.push_back(entry.path().string());
+            std::sort(found.begin(), found.end());
+            files.insert(files.end(), found.begin(), found.end());
+        } else if (pattern.find_first_of("*?[") != std::string::npos) {
+            glob_t matches;
+            if (glob(pattern.c_str(), 0, NULL, &matches) == 0)
+                for (size_t k = 0; k < matches.gl_pathc; k++) files.push_back(matches.gl_pathv[k]);
+            globfree(&matches);
+        } else files.push_back(pattern);
+    }
+
+    return files;
+}
+
+/* Shows many pixel arts at once, each shrunk into a square with its name under it. The squares are as large as
+ * they can be with all of them on the screen (down to a minimum). The files are loaded and shrunk on a pool of
+ * threads, and the thumbnails are put together in one canvas, which is drawn in one go. */
+void contact_sheet(const std::vector<std::string>& filenames) {
+    static const uint MIN_SIZE = 8;
+    static const uint MAX_SIZE = 48;
+
+    struct winsize w = {};
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+    uint cols = w.ws_col > 0 ? w.ws_col : 80;
+    uint rows = w.ws_row > 1 ? w.ws_row - 1 : 23; // Leaving a row for the prompt afterwards
+
+    // In pixels, with a column between the squares and a row of text for the names under them
+    uint n = filenames.size();
+    uint label = Canvas::half_blocks ? 2 : 1;
+    uint screen_width = Canvas::half_blocks ? cols : cols / 2;
+    uint screen_height = Canvas::half_blocks ? 2 * rows : rows;
+    uint size = MIN_SIZE;
+    for (uint s = MAX_SIZE; s > MIN_SIZE; s--) {
+        uint per_row = std::max(1u, (screen_width + 1) / (s + 1));
+        uint box = (s + label - 1) / label * label; // Names start on a row of their own
+        if ((n + per_row - 1) / per_row * (box + label) <= screen_height) {
+            size = s;
+            break;
+        }
+    }
+    uint per_row = std::max(1u, (screen_width + 1) / (size + 1));
+    uint box = (size + label - 1) / label * label;
+
+    struct Thumbnail {
+        std::unique_ptr<Pixel[]> pixels;
+        uint width = 0;
+        uint height = 0;
+        std::string error;
+    };
+
+    std::vector<Thumbnail> thumbnails(n);
+    std::atomic<uint> next = 0;
+    auto work = [&]() {
+        for (uint k; (k = next++) < n;) {
+            try {
+                Canvas canvas(filenames[k]);
+                thumbnails[k].pixels.reset(canvas.thumbnail(size, thumbnails[k].width, thumbnails[k].height));
+            } catch (std::exception& e) {
+                thumbnails[k].error = e.what();
+            }
+        }
+    };
+
+    uint count = std::clamp<uint>(std::thread::hardware_concurrency(), 1, n);
+    std::vector<std::thread> threads;
+    for (uint k = 1; k < count; k++) threads.emplace_back(work);
+    work();
+    for (std::thread& t : threads) t.join();
+
+    Canvas sheet(std::min(n, per_row) * (size + 1) - 1, (n + per_row - 1) / per_row * (box + label));
+    std::string names = "\033[0m";
+    std::string errors;
+    for (uint k = 0; k < n; k++) {
+        const Thumbnail& t = thumbnails[k];
+        uint x = k % per_row * (size + 1);
+        uint y = k / per_row * (box + label);
+        if (t.pixels) sheet.paste(t.pixels.get(), t.width, t.height, Point<uint>(x + (size - t.width) / 2, y + (box - t.height) / 2));
+        else errors += std::format("Failed to display {}: {}\n", filenames[k], t.error);
+
+        std::string name = std::filesystem::path(filenames[k]).filename().string();
+        names += std::format("\033[{};{}H{}", Canvas::screen_rows(y + box) + 1, Canvas::screen_cols(x) + 1, name.substr(0, Canvas::screen_cols(size)));
+    }
+
+    std::cout << "\033[2J\033[H";
+    sheet.display();
+    std::cout << names << std::format("\033[{};1H", Canvas::screen_rows(sheet.get_height()) + 1) << errors << std::flush;
 }
 
 int main(int argc, char** argv) {
     uint width = -1;
     uint height = -1;
     std::string fname;
+    std::vector<std::string> display_fnames;
+    std::string play_fname;
+    std::string publish_name;
+    std::string follow_name;
+    bool loop = false;
+    bool watching = false;
+    std::string import_fname;
+    std::string import_ansi_fname;
+    std::string output_fname;
+    std::string recover_fname;
+    std::string record_fname;
+    std::string replay_fname;
+    uint zoom = 1;
+    bool stored = false;
+    ColorMode colors = TRUECOLOR;
+    std::vector<ColorAdjustment> adjustments;
+    uint scale_width = 0;
+    uint scale_height = 0;
+    ScaleMode scale_mode = SCALE_NEAREST;
 
     int i = 1;
     while (i < argc) {
@@ -1611,44 +6829,324 @@ int main(int argc, char** argv) {
             fname = argv[i+1];
             i += 2;
         } else if (arg == "help") {
-            std::ifstream help_file;
-            help_file.open("help.txt");
-
-            std::string line;
-            while (!help_file.eof()) {
-                std::getline(help_file, line);
-                std::cout << line << std::endl;
-            }
-
-            help_file.close();
+            std::cout << help_text << std::flush;
+            i++;
+        } else if (arg == "scroll-regions") {
+            OutputTerminal::scroll_regions = true;
             i++;
         } else if (arg == "display") {
+            for (i++; i < argc && std::string(argv[i]).rfind("--", 0) != 0; i++) display_fnames.push_back(argv[i]);
+            if (display_fnames.empty()) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+        } else if (arg == "play") {
             if (argc < i + 2) {
                 std::print("Must provide filename\n");
                 std::exit(1);
             }
-            std::cout << "\033[2J\033[H" << std::flush;
-            Canvas canvas(argv[i + 1]);
-            canvas.display();
-            std::cout << std::endl << std::endl;
-            std::exit(0);
+            play_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "publish") {
+            if (argc < i + 2) {
+                std::print("Must provide name\n");
+                std::exit(1);
+            }
+            publish_name = argv[i + 1];
+            i += 2;
+        } else if (arg == "follow") {
+            if (argc < i + 2) {
+                std::print("Must provide name\n");
+                std::exit(1);
+            }
+            follow_name = argv[i + 1];
+            i += 2;
+        } else if (arg == "watch") {
+            watching = true;
+            i++;
+        } else if (arg == "loop") {
+            loop = true;
+            i++;
+        } else if (arg == "import") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            import_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "import-ansi") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            import_ansi_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "recover") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            recover_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "record") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            record_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "replay") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            replay_fname = argv[i + 1];
+            i += 2;
+        } else if (arg == "zoom") {
+            if (argc < i + 2) {
+                std::print("Must provide zoom\n");
+                std::exit(1);
+            }
+            int n = std::stoi(argv[i + 1]);
+            if (n <= 0) {
+                std::print("Must provide a positive zoom\n");
+                std::exit(1);
+            }
+            zoom = n;
+            i += 2;
+        } else if (arg == "colors") {
+            if (argc < i + 2) {
+                std::print("Must provide color mode\n");
+                std::exit(1);
+            }
+            std::string mode = argv[i + 1];
+            if (mode == "truecolor") colors = TRUECOLOR;
+            else if (mode == "256") colors = COLORS_256;
+            else if (mode == "16") colors = COLORS_16;
+            else {
+                std::print("Invalid color mode {} (must be 256, 16 or truecolor)\n", mode);
+                std::exit(1);
+            }
+            i += 2;
+        } else if (arg == "kitty") {
+            Canvas::renderer = new KittyRenderer();
+            i++;
+        } else if (arg == "half-blocks") {
+            Canvas::half_blocks = true;
+            i++;
+        } else if (arg == "dither") {
+            Palette::dither = true;
+            i++;
+        } else if (arg == "stored") {
+            stored = true;
+            i++;
+        } else if (arg == "scale") {
+            if (argc < i + 4) {
+                std::print("Must provide dimensions and a mode\n");
+                std::exit(1);
+            }
+            int w = std::stoi(argv[i + 1]), h = std::stoi(argv[i + 2]);
+            if (w <= 0 || h <= 0 || w > Canvas::MAX_SCALE || h > Canvas::MAX_SCALE) {
+                std::print("Scaled dimensions must be between 1 and {}\n", Canvas::MAX_SCALE);
+                std::exit(1);
+            }
+            scale_width = w;
+            scale_height = h;
+            std::string mode = argv[i + 3];
+            if (mode == "nearest") scale_mode = SCALE_NEAREST;
+            else if (mode == "bilinear") scale_mode = SCALE_BILINEAR;
+            else if (mode == "area") scale_mode = SCALE_AREA;
+            else {
+                std::print("Invalid scale mode {} (must be nearest, bilinear or area)\n", mode);
+                std::exit(1);
+            }
+            i += 4;
+        } else if (arg == "adjust") {
+            if (argc < i + 2) {
+                std::print("Must provide adjustment\n");
+                std::exit(1);
+            }
+            try {
+                adjustments.push_back(ColorAdjustment(split_string(argv[i + 1], " ")));
+            } catch (std::invalid_argument& e) {
+                std::print("Invalid adjustment {}: {}\n", argv[i + 1], e.what());
+                std::exit(1);
+            }
+            i += 2;
+        } else if (arg == "output") {
+            if (argc < i + 2) {
+                std::print("Must provide filename\n");
+                std::exit(1);
+            }
+            output_fname = argv[i + 1];
+            i += 2;
         } else {
             std::print("Invalid flag {}\n", arg);
             std::exit(1);
         }
     }
 
+    Palette::set_mode(colors);
+
+    std::vector<std::string> display_files;
+    if (!display_fnames.empty()) {
+        try {
+            display_files = expand_files(display_fnames);
+        } catch (std::exception& e) {
+            std::print("Failed to list files: {}\n", e.what());
+            std::exit(1);
+        }
+        if (display_files.empty()) {
+            std::print("No files to display\n");
+            std::exit(1);
+        }
+        if (watching && display_files.size() > 1) {
+            std::print("Can only watch one file\n");
+            std::exit(1);
+        }
+    }
+
+    if (!display_files.empty() && watching) {
+        try {
+            watch(display_files[0]);
+        } catch (std::exception& e) {
+            std::print("Failed to watch {}: {}\n", display_files[0], e.what());
+            std::exit(1);
+        }
+        std::exit(0);
+    } else if (display_files.size() > 1) {
+        contact_sheet(display_files);
+        std::exit(0);
+    } else if (!display_files.empty()) {
+        std::cout << "\033[2J\033[H" << std::flush;
+        Canvas canvas(display_files[0]);
+        canvas.display();
+        std::cout << std::format("\033[{};1H", Canvas::screen_rows(canvas.get_height())) << std::endl << std::endl;
+        std::exit(0);
+    } else if (follow_name != "") {
+        try {
+            follow(follow_name);
+        } catch (std::exception& e) {
+            std::print("Failed to follow {}: {}\n", follow_name, e.what());
+            std::exit(1);
+        }
+        std::exit(0);
+    } else if (play_fname != "") {
+        if (Animation::is_animation(play_fname)) {
+            Animation anim(play_fname);
+            Player(anim).play(loop);
+        } else {
+            Canvas canvas(play_fname);
+            Animation anim({canvas.snapshot()}, {0});
+            Player(anim).play(false);
+        }
+        std::exit(0);
+    }
+
+    std::unique_ptr<ImageReader> image;
+    if (import_fname != "") {
+        try {
+            image = open_image(import_fname);
+        } catch (std::exception& e) {
+            std::print("Failed to import {}: {}\n", import_fname, e.what());
+            std::exit(1);
+        }
+
+        if (width == -1 || height == -1) { // Shrink the image to fit next to the editor's panes
+            struct winsize w = {};
+            ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+            double max_width = w.ws_col > 40 ? (w.ws_col - 20) / 2 : 10;
+            double max_height = w.ws_row > 8 ? w.ws_row - 4 : 4;
+            if (Canvas::half_blocks) {
+                max_width *= 2;
+                max_height *= 2;
+            }
+            double scale = std::min({1., max_width / image->get_width(), max_height / image->get_height()});
+            if (output_fname != "") scale = 1;
+            width = std::max(1l, std::lround(image->get_width() * scale));
+            height = std::max(1l, std::lround(image->get_height() * scale));
+        }
+    }
+
+    std::unique_ptr<AnsiParser> ansi;
+    if (import_ansi_fname != "") {
+        try {
+            ansi = std::make_unique<AnsiParser>(AnsiParser::parse_file(import_ansi_fname));
+        } catch (std::exception& e) {
+            std::print("Failed to import {}: {}\n", import_ansi_fname, e.what());
+            std::exit(1);
+        }
+        if (ansi->was_cut())
+            std::print("{} is larger than {}x{} cells, and was cut off\n", import_ansi_fname, AnsiParser::MAX_COLUMNS, AnsiParser::MAX_ROWS);
+
+        if (width == -1 || height == -1) {
+            Point<uint> size = Canvas::ansi_size(*ansi);
+            width = size.x;
+            height = size.y;
+        }
+    }
+
+    if (output_fname != "") { // Convert without opening the editor
+        try {
+            Canvas canvas = image || ansi ? Canvas(width, height) : Canvas(fname);
+            if (image) canvas.import_image(*image, Point<uint>(0,0), width, height);
+            if (ansi) canvas.import_ansi(*ansi, Point<uint>(0,0));
+            if (scale_width != 0) canvas.scale(scale_width, scale_height, scale_mode);
+            for (const ColorAdjustment& a : adjustments) canvas.adjust(a);
+            if (output_fname.ends_with(".tart")) canvas.save(output_fname);
+            else canvas.export_file(output_fname, zoom, stored);
+        } catch (std::exception& e) {
+            std::print("Failed to write {}: {}\n", output_fname, e.what());
+            std::exit(1);
+        }
+        std::exit(0);
+    }
+
+    try {
+        if (record_fname != "") Session::record(record_fname);
+    } catch (std::exception& e) {
+        std::print("Failed to record to {}: {}\n", record_fname, e.what());
+        std::exit(1);
+    }
+    try {
+        if (replay_fname != "") Session::replay_file(replay_fname);
+    } catch (std::exception& e) {
+        std::print("Failed to replay {}: {}\n", replay_fname, e.what());
+        std::exit(1);
+    }
+
     Drawer* d = NULL;
 
-    if (width != -1 && height != -1) {
+    if (replay_fname != "") { // The canvas comes from the recording
+        d = new Drawer(1, 1);
+    } else if (recover_fname != "") { // Or from the checkpoint in the log
+        std::vector<OpLog::Record> records = OpLog::read(recover_fname);
+        if (std::none_of(records.begin(), records.end(), [](const OpLog::Record& r) { return r.type == OpLog::CHECKPOINT; })) {
+            std::print("Nothing to recover in {}\n", recover_fname);
+            std::exit(1);
+        }
+        d = new Drawer(1, 1, recover_fname);
+    } else if (width != -1 && height != -1) {
         d = new Drawer(width, height);
+        if (image) d->canvas.import_image(*image, Point<uint>(0,0), width, height);
+        if (ansi) d->canvas.import_ansi(*ansi, Point<uint>(0,0));
     } else if (fname != "") {
         d = new Drawer(fname);
     }
 
     if (d != NULL) {
+        if (publish_name != "") {
+            try {
+                Canvas::shared = new SharedCanvas(publish_name, true);
+            } catch (std::exception& e) {
+                std::print("Failed to publish {}: {}\n", publish_name, e.what());
+                std::exit(1);
+            }
+        }
         d->main();
+        if (Session::replaying()) std::print("{}", Session::report(d->hash()));
         delete d;
+        delete Canvas::shared;
     }
 }
 